@@ -45,11 +45,30 @@ public:
 		return m_data.i == 0;
 	}
 
+	bool operator==(const IPv4 &o) const {
+		return m_data.i == o.m_data.i;
+	}
+	bool operator!=(const IPv4 &o) const {
+		return !(*this == o);
+	}
+
 	struct less {
 		bool operator()(const IPv4 &a, const IPv4 &b) const {
 			return a.m_data.i < b.m_data.i;
 		}
 	};
+
+	struct hash {
+		size_t operator()(const IPv4 &a) const {
+			uint32_t x = a.m_data.i;
+			x ^= x >> 16;
+			x *= 0x85ebca6bu;
+			x ^= x >> 13;
+			x *= 0xc2b2ae35u;
+			x ^= x >> 16;
+			return x;
+		}
+	};
 };
 
 class IPv6 {
@@ -90,12 +109,31 @@ public:
 		return m_data.l[0] == 0 && m_data.l[1] == 0;
 	}
 
+	bool operator==(const IPv6 &o) const {
+		return m_data.l[0] == o.m_data.l[0] && m_data.l[1] == o.m_data.l[1];
+	}
+	bool operator!=(const IPv6 &o) const {
+		return !(*this == o);
+	}
+
 	struct less {
 		bool operator()(const IPv6 &a, const IPv6 &b) const {
 			if (a.m_data.l[0] != b.m_data.l[0]) return a.m_data.l[0] < b.m_data.l[0];
 			return a.m_data.l[1] < b.m_data.l[1];
 		}
 	};
+
+	struct hash {
+		size_t operator()(const IPv6 &a) const {
+			uint64_t x = a.m_data.l[0] ^ (a.m_data.l[1] * 0x9e3779b97f4a7c15u);
+			x ^= x >> 33;
+			x *= 0xff51afd7ed558ccdu;
+			x ^= x >> 33;
+			x *= 0xc4ceb9fe1a85ec53u;
+			x ^= x >> 33;
+			return static_cast<size_t>(x);
+		}
+	};
 };
 
 template <typename IP_T> 
@@ -192,6 +230,19 @@ public:
 	void set_port(uint16_t port) {
 		m_port = port;
 	};
+
+	bool operator==(const address &o) const {
+		return m_ip == o.m_ip && m_port == o.m_port;
+	}
+	bool operator!=(const address &o) const {
+		return !(*this == o);
+	}
+
+	struct hash {
+		size_t operator()(const address &a) const {
+			return typename IP_T::hash()(a.m_ip) ^ a.m_port * 0x9e3779b1u;
+		}
+	};
 };
 
 using addr_ipv4 = address<IPv4>;
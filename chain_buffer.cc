@@ -0,0 +1,125 @@
+#include "chain_buffer.h"
+
+#include <cstring>
+#include <algorithm>
+
+using std::min;
+
+block_pool::~block_pool() {
+	while (m_free) {
+		block *b = m_free;
+		m_free = b->next;
+		delete b;
+	}
+}
+
+block_pool::block *block_pool::get() {
+	block *b = m_free;
+	if (b) {
+		m_free = b->next;
+		--m_spare;
+	} else {
+		b = new block;
+	}
+	b->next = nullptr;
+	b->begin = b->end = 0;
+	return b;
+}
+
+void block_pool::put(block *b) {
+	if (m_spare == max_spare) {
+		delete b;
+		return;
+	}
+	b->next = m_free;
+	m_free = b;
+	++m_spare;
+}
+
+block_pool &block_pool::local() {
+	thread_local block_pool pool;
+	return pool;
+}
+
+chain_buffer::chain_buffer(chain_buffer &&b) :
+	m_head(b.m_head), m_tail(b.m_tail), m_size(b.m_size) {
+	b.m_head = b.m_tail = nullptr;
+	b.m_size = 0;
+}
+
+chain_buffer &chain_buffer::operator=(chain_buffer &&b) {
+	if (&b == this) return *this;
+	clear();
+	m_head = b.m_head, m_tail = b.m_tail, m_size = b.m_size;
+	b.m_head = b.m_tail = nullptr;
+	b.m_size = 0;
+	return *this;
+}
+
+void chain_buffer::append(const uint8_t *data, size_t len) {
+	m_size += len;
+	while (len) {
+		if (!m_tail || m_tail->end == block_pool::block_size) {
+			block_pool::block *b = block_pool::local().get();
+			if (m_tail)
+				m_tail->next = b;
+			else
+				m_head = b;
+			m_tail = b;
+		}
+		size_t n = min(len, block_pool::block_size - m_tail->end);
+		memcpy(m_tail->data + m_tail->end, data, n);
+		m_tail->end += n;
+		data += n, len -= n;
+	}
+}
+
+size_t chain_buffer::spans(const uint8_t **bufs, size_t *lens, size_t n, size_t offset) const {
+	assert(m_size >= offset);
+	const block_pool::block *b = m_head;
+	for (; b && offset >= b->end - b->begin; b = b->next)
+		offset -= b->end - b->begin;
+
+	size_t k = 0;
+	for (; b && k < n; b = b->next, ++k, offset = 0) {
+		bufs[k] = b->data + b->begin + offset;
+		lens[k] = b->end - b->begin - offset;
+	}
+	return k;
+}
+
+void chain_buffer::consume(size_t n) {
+	assert(m_size >= n);
+	m_size -= n;
+	while (n) {
+		size_t m = min(n, m_head->end - m_head->begin);
+		m_head->begin += m;
+		n -= m;
+		if (m_head->begin == m_head->end) {
+			block_pool::block *b = m_head;
+			if (!(m_head = b->next)) m_tail = nullptr;
+			block_pool::local().put(b);
+		}
+	}
+}
+
+void chain_buffer::abandon(size_t n) {
+	assert(m_size >= n);
+	while (n) {
+		block_pool::block *b = m_head;
+		size_t len = b->end - b->begin;
+		n -= min(n, len);
+		m_size -= len;
+		if (!(m_head = b->next)) m_tail = nullptr;
+	}
+}
+
+void chain_buffer::clear() {
+	while (m_head) {
+		block_pool::block *b = m_head;
+		m_head = b->next;
+		block_pool::local().put(b);
+	}
+	m_tail = nullptr;
+	m_size = 0;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+
+// fixed-size blocks for chain_buffer. every thread has its own pool, which
+// keeps up to max_spare freed blocks for reuse and gives the rest back to
+// the allocator, so a connection with nothing queued holds no memory.
+class block_pool {
+public:
+	static constexpr size_t block_size = 16384;
+	static constexpr size_t max_spare = 64;
+
+	struct block {
+		block *next;
+		// the data is [begin, end)
+		size_t begin, end;
+		uint8_t data[block_size];
+	};
+
+	block_pool() = default;
+	block_pool(const block_pool &) = delete;
+	block_pool &operator=(const block_pool &) = delete;
+	~block_pool();
+
+	block *get();
+	void put(block *b);
+
+	// the pool of the calling thread
+	static block_pool &local();
+
+private:
+	block *m_free = nullptr;
+	size_t m_spare = 0;
+};
+
+// a byte queue made of a list of blocks from the thread's block_pool. it
+// grows a block at a time, so appending never moves what is queued, and
+// hands its blocks back as soon as they are consumed.
+class chain_buffer {
+	block_pool::block *m_head = nullptr, *m_tail = nullptr;
+	size_t m_size = 0;
+
+public:
+	chain_buffer() = default;
+	chain_buffer(const chain_buffer &) = delete;
+	chain_buffer &operator=(const chain_buffer &) = delete;
+	chain_buffer(chain_buffer &&b);
+	chain_buffer &operator=(chain_buffer &&b);
+	~chain_buffer() {
+		clear();
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+	bool empty() const {
+		return m_size == 0;
+	}
+
+	void append(const uint8_t *data, size_t len);
+	// the data from offset on as up to n contiguous spans, in order; returns how many there are
+	size_t spans(const uint8_t **bufs, size_t *lens, size_t n, size_t offset = 0) const;
+	// drops n bytes from the front
+	void consume(size_t n);
+	// drops the blocks holding the first n bytes without freeing them, for
+	// memory something else may still be reading
+	void abandon(size_t n);
+	void clear();
+};
@@ -5,6 +5,7 @@
 
 #include <string>
 #include <stdexcept>
+#include <utility>
 #include <cassert>
 
 using std::string;
@@ -12,34 +13,62 @@ using std::runtime_error;
 using std::logic_error;
 using std::to_string;
 
-size_t aes_128_gcm::encrypt(const uint8_t *key, const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *encrypted, size_t cap, uint8_t *tag) {
-	thread_local static EVP_CIPHER_CTX *ctx = nullptr;
+aead_ctx::aead_ctx(aead_ctx &&c) noexcept : m_enc(c.m_enc), m_dec(c.m_dec) {
+	c.m_enc = c.m_dec = nullptr;
+}
 
-	if (cap < len + padding_size) throw runtime_error("cap is not large enough");
+aead_ctx &aead_ctx::operator=(aead_ctx &&c) noexcept {
+	std::swap(m_enc, c.m_enc);
+	std::swap(m_dec, c.m_dec);
+	return *this;
+}
 
-	int n0, n1;
+// freeing a context also wipes the key schedule in it
+aead_ctx::~aead_ctx() {
+	EVP_CIPHER_CTX_free(m_enc);
+	EVP_CIPHER_CTX_free(m_dec);
+}
+
+void aead_ctx::set_key(const EVP_CIPHER *cipher, const uint8_t *key) {
+	if (!m_enc && !(m_enc = EVP_CIPHER_CTX_new()))
+		goto error;
+	if (!m_dec && !(m_dec = EVP_CIPHER_CTX_new()))
+		goto error;
 
-	if (!ctx) {
-		if (!(ctx = EVP_CIPHER_CTX_new()))
-			goto error;
-		if (!EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), nullptr, nullptr, nullptr))
-			goto error;
+	if (!EVP_EncryptInit_ex(m_enc, cipher, nullptr, key, nullptr))
+		goto error;
+	if (!EVP_DecryptInit_ex(m_dec, cipher, nullptr, key, nullptr))
+		goto error;
+	return;
 
-		assert(EVP_CIPHER_CTX_key_length(ctx) == key_size);
-		assert(EVP_CIPHER_CTX_iv_length(ctx) == iv_size);
-		assert(EVP_CIPHER_CTX_block_size(ctx) == block_size);
-	}
+error:
+	auto err = ERR_get_error();
+	thread_local static char buf[256];
+	ERR_error_string_n(err, buf, sizeof(buf));
+	throw runtime_error(buf);
+}
 
-	if (!EVP_EncryptInit_ex(ctx, nullptr, nullptr, key, iv))
+size_t aes_128_gcm::encrypt(const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *encrypted, size_t cap, uint8_t *tag) {
+	if (!m_enc) throw logic_error("the key has not been set");
+	if (cap < len + padding_size) throw runtime_error("cap is not large enough");
+
+	assert(EVP_CIPHER_CTX_key_length(m_enc) == key_size);
+	assert(EVP_CIPHER_CTX_iv_length(m_enc) == iv_size);
+	assert(EVP_CIPHER_CTX_block_size(m_enc) == block_size);
+
+	int n0, n1;
+
+	// the key schedule is already loaded
+	if (!EVP_EncryptInit_ex(m_enc, nullptr, nullptr, nullptr, iv))
 		goto error;
 
-	if (!EVP_EncryptUpdate(ctx, encrypted, &n0, data, len))
+	if (!EVP_EncryptUpdate(m_enc, encrypted, &n0, data, len))
 		goto error;
 
-	if (!EVP_EncryptFinal(ctx, encrypted + n0, &n1))
+	if (!EVP_EncryptFinal(m_enc, encrypted + n0, &n1))
 		goto error;
 
-	if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag_size, tag))
+	if (!EVP_CIPHER_CTX_ctrl(m_enc, EVP_CTRL_GCM_GET_TAG, tag_size, tag))
 		goto error;
 
 	return n0 + n1;
@@ -51,35 +80,25 @@ error:
 	throw runtime_error(buf);
 }
 
-size_t aes_128_gcm::decrypt(const uint8_t *key, const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *decrypted, size_t cap, uint8_t *tag) {
-	thread_local static EVP_CIPHER_CTX *ctx = nullptr;
+size_t aes_128_gcm::decrypt(const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *decrypted, size_t cap, uint8_t *tag) {
+	if (!m_dec) throw logic_error("the key has not been set");
 
 	int n0, n1;
 
-	if (!ctx) {
-		if (!(ctx = EVP_CIPHER_CTX_new()))
-			goto error;
-		if (!EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), nullptr, nullptr, nullptr))
-			goto error;
-
-		assert(EVP_CIPHER_CTX_key_length(ctx) == key_size);
-		assert(EVP_CIPHER_CTX_iv_length(ctx) == iv_size);
-		assert(EVP_CIPHER_CTX_block_size(ctx) == block_size);
-	}
-
-	if (!EVP_DecryptInit_ex(ctx, nullptr, nullptr, key, iv))
+	if (!EVP_DecryptInit_ex(m_dec, nullptr, nullptr, nullptr, iv))
 		goto error;
 
-	if (!EVP_DecryptUpdate(ctx, decrypted, &n0, data, len))
+	if (!EVP_DecryptUpdate(m_dec, decrypted, &n0, data, len))
 		goto error;
 
-	if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tag_size, tag))
+	if (!EVP_CIPHER_CTX_ctrl(m_dec, EVP_CTRL_GCM_SET_TAG, tag_size, tag))
 		goto error;
 
-	if (!EVP_DecryptFinal(ctx, decrypted + n0, &n1))
+	if (!EVP_DecryptFinal(m_dec, decrypted + n0, &n1))
 		goto error;
 
 	return n0 + n1;
+
 error:
 	auto err = ERR_get_error();
 	thread_local static char buf[256];
@@ -87,34 +106,27 @@ error:
 	throw runtime_error(buf);
 }
 
-size_t chacha20_poly1305::encrypt(const uint8_t *key, const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *encrypted, size_t cap, uint8_t *tag) {
-	thread_local static EVP_CIPHER_CTX *ctx = nullptr;
-
+size_t chacha20_poly1305::encrypt(const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *encrypted, size_t cap, uint8_t *tag) {
+	if (!m_enc) throw logic_error("the key has not been set");
 	if (cap < len + padding_size) throw runtime_error("cap is not large enough");
 
-	int n0, n1;
-
-	if (!ctx) {
-		if (!(ctx = EVP_CIPHER_CTX_new()))
-			goto error;
-		if (!EVP_EncryptInit_ex(ctx, EVP_chacha20_poly1305(), nullptr, nullptr, nullptr))
-			goto error;
+	assert(EVP_CIPHER_CTX_key_length(m_enc) == key_size);
+	assert(EVP_CIPHER_CTX_iv_length(m_enc) == iv_size);
+	assert(EVP_CIPHER_CTX_block_size(m_enc) == block_size);
 
-		assert(EVP_CIPHER_CTX_key_length(ctx) == key_size);
-		assert(EVP_CIPHER_CTX_iv_length(ctx) == iv_size);
-		assert(EVP_CIPHER_CTX_block_size(ctx) == block_size);
-	}
+	int n0, n1;
 
-	if (!EVP_EncryptInit_ex(ctx, nullptr, nullptr, key, iv))
+	// the key schedule is already loaded
+	if (!EVP_EncryptInit_ex(m_enc, nullptr, nullptr, nullptr, iv))
 		goto error;
 
-	if (!EVP_EncryptUpdate(ctx, encrypted, &n0, data, len))
+	if (!EVP_EncryptUpdate(m_enc, encrypted, &n0, data, len))
 		goto error;
 
-	if (!EVP_EncryptFinal(ctx, encrypted + n0, &n1))
+	if (!EVP_EncryptFinal(m_enc, encrypted + n0, &n1))
 		goto error;
 
-	if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, tag_size, tag))
+	if (!EVP_CIPHER_CTX_ctrl(m_enc, EVP_CTRL_AEAD_GET_TAG, tag_size, tag))
 		goto error;
 
 	return n0 + n1;
@@ -126,35 +138,25 @@ error:
 	throw runtime_error(buf);
 }
 
-size_t chacha20_poly1305::decrypt(const uint8_t *key, const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *decrypted, size_t cap, uint8_t *tag) {
-	thread_local static EVP_CIPHER_CTX *ctx = nullptr;
+size_t chacha20_poly1305::decrypt(const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *decrypted, size_t cap, uint8_t *tag) {
+	if (!m_dec) throw logic_error("the key has not been set");
 
 	int n0, n1;
 
-	if (!ctx) {
-		if (!(ctx = EVP_CIPHER_CTX_new()))
-			goto error;
-		if (!EVP_DecryptInit_ex(ctx, EVP_chacha20_poly1305(), nullptr, nullptr, nullptr))
-			goto error;
-
-		assert(EVP_CIPHER_CTX_key_length(ctx) == key_size);
-		assert(EVP_CIPHER_CTX_iv_length(ctx) == iv_size);
-		assert(EVP_CIPHER_CTX_block_size(ctx) == block_size);
-	}
-
-	if (!EVP_DecryptInit_ex(ctx, nullptr, nullptr, key, iv))
+	if (!EVP_DecryptInit_ex(m_dec, nullptr, nullptr, nullptr, iv))
 		goto error;
 
-	if (!EVP_DecryptUpdate(ctx, decrypted, &n0, data, len))
+	if (!EVP_DecryptUpdate(m_dec, decrypted, &n0, data, len))
 		goto error;
 
-	if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, tag_size, tag))
+	if (!EVP_CIPHER_CTX_ctrl(m_dec, EVP_CTRL_AEAD_SET_TAG, tag_size, tag))
 		goto error;
 
-	if (!EVP_DecryptFinal(ctx, decrypted + n0, &n1))
+	if (!EVP_DecryptFinal(m_dec, decrypted + n0, &n1))
 		goto error;
 
 	return n0 + n1;
+
 error:
 	auto err = ERR_get_error();
 	thread_local static char buf[256];
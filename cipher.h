@@ -1,140 +1,189 @@
 #pragma once
 
 #include <openssl/evp.h>
-#include <openssl/bn.h>
 #include <openssl/rand.h>
 
 #include <cstring>
 #include <string>
 #include <stdexcept>
+#include <type_traits>
+
+#include "packet.h"
 
 typedef std::basic_string<unsigned char> ustring;
 
-struct aes_128_gcm {
+// the EVP contexts of an aead, one to encrypt and one to decrypt with. they
+// are keyed once, by set_key(), and each packet only loads its iv. an object
+// may be used by one encrypting and one decrypting thread at a time.
+class aead_ctx {
+public:
+	aead_ctx() = default;
+	aead_ctx(const aead_ctx &) = delete;
+	aead_ctx &operator=(const aead_ctx &) = delete;
+	aead_ctx(aead_ctx &&c) noexcept;
+	aead_ctx &operator=(aead_ctx &&c) noexcept;
+	~aead_ctx();
+
+protected:
+	void set_key(const EVP_CIPHER *cipher, const uint8_t *key);
+
+	EVP_CIPHER_CTX *m_enc = nullptr, *m_dec = nullptr;
+};
+
+struct aes_128_gcm : aead_ctx {
 	static const size_t key_size = 16;
 	static const size_t iv_size = 12;
 	static const size_t tag_size = 16;
 	static const size_t block_size = 1;
 	static const size_t padding_size = block_size - 1;
 
-	size_t encrypt(const uint8_t *key, const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *encrypted, size_t cap, uint8_t *tag);
-	size_t decrypt(const uint8_t *key, const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *decrypted, size_t cap, uint8_t *tag);
+	void set_key(const uint8_t *key) {
+		aead_ctx::set_key(EVP_aes_128_gcm(), key);
+	}
+
+	size_t encrypt(const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *encrypted, size_t cap, uint8_t *tag);
+	size_t decrypt(const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *decrypted, size_t cap, uint8_t *tag);
 };
 
-struct chacha20_poly1305 {
+struct chacha20_poly1305 : aead_ctx {
 	static const size_t key_size = 32;
 	static const size_t iv_size = 12;
 	static const size_t tag_size = 16;
 	static const size_t block_size = 1;
 	static const size_t padding_size = block_size - 1;
 
-	size_t encrypt(const uint8_t *key, const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *encrypted, size_t cap, uint8_t *tag);
-	size_t decrypt(const uint8_t *key, const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *decrypted, size_t cap, uint8_t *tag);
+	void set_key(const uint8_t *key) {
+		aead_ctx::set_key(EVP_chacha20_poly1305(), key);
+	}
+
+	size_t encrypt(const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *encrypted, size_t cap, uint8_t *tag);
+	size_t decrypt(const uint8_t *iv, const uint8_t *data, size_t len, uint8_t *decrypted, size_t cap, uint8_t *tag);
 };
 
 template <typename Aead>
 struct aead_indep : public Aead {
-	static const size_t min_cap = Aead::iv_size + Aead::tag_size + Aead::padding_size;
+	static_assert(Aead::padding_size == 0);
 
-	size_t encrypt(const uint8_t *key, const uint8_t *data, size_t len, uint8_t *encrypted, size_t cap) {
-		thread_local static uint8_t tag[Aead::tag_size];
+	static const size_t headroom = Aead::iv_size;
+	static const size_t tailroom = Aead::tag_size;
+	static const size_t min_cap = headroom + tailroom;
 
-		if (cap < len + min_cap) throw std::runtime_error("cap is not large enough");
+	void init(const uint8_t *key) {
+		Aead::set_key(key);
+	}
 
-		// iv load tag
-		RAND_bytes(encrypted, Aead::iv_size);
-		size_t n = Aead::encrypt(key, encrypted, data, len, encrypted + Aead::iv_size, cap - Aead::iv_size - Aead::tag_size, tag);
-		memcpy(encrypted + Aead::iv_size + n, tag, Aead::tag_size);
-		return Aead::iv_size + n + Aead::tag_size;
+	// encrypts the payload of p in place and frames it as iv | ciphertext | tag
+	void encrypt(packet_buf &p) {
+		if (p.headroom() < headroom || p.tailroom() < tailroom)
+			throw std::runtime_error("packet has no room for the iv and tag");
+
+		size_t len = p.size();
+		uint8_t *iv = p.push(Aead::iv_size), *data = iv + Aead::iv_size;
+		uint8_t *tag = p.put(Aead::tag_size);
+		next_iv(iv);
+		Aead::encrypt(iv, data, len, data, len, tag);
 	}
-	size_t decrypt(const uint8_t *key, const uint8_t *data, size_t len, uint8_t *decrypted, size_t cap) {
-		thread_local static uint8_t tag[Aead::tag_size];
 
-		// iv load tag
-		memcpy(tag, data + len - Aead::tag_size, Aead::tag_size);
-		return Aead::decrypt(key, data, data + Aead::iv_size, len - Aead::iv_size - Aead::tag_size, decrypted, cap, tag);
+	// decrypts a framed packet in place, leaving only the plaintext in p
+	void decrypt(packet_buf &p) {
+		if (p.size() < min_cap)
+			throw std::runtime_error("packet is too short");
+
+		size_t len = p.size() - min_cap;
+		uint8_t *iv = p.data(), *data = iv + Aead::iv_size, *tag = data + len;
+		Aead::decrypt(iv, data, len, data, len, tag);
+		p.pull(Aead::iv_size);
+		p.resize(len);
+	}
 
+private:
+	// each sending thread draws an 8-byte random prefix once and then counts
+	// up in the last 4 bytes, so ivs never repeat and no state is shared
+	// between threads. a new prefix is drawn when the counter wraps.
+	static void next_iv(uint8_t *iv) {
+		static_assert(Aead::iv_size == 12);
+		thread_local static uint8_t prefix[8];
+		thread_local static uint32_t counter = 0;
+
+		if (counter == 0 && RAND_bytes(prefix, sizeof(prefix)) != 1)
+			throw std::runtime_error("fail to draw an iv prefix");
+
+		memcpy(iv, prefix, sizeof(prefix));
+		iv[8] = static_cast<uint8_t>(counter >> 24);
+		iv[9] = static_cast<uint8_t>(counter >> 16);
+		iv[10] = static_cast<uint8_t>(counter >> 8);
+		iv[11] = static_cast<uint8_t>(counter);
+		++counter;
 	}
 };
 
 using aes_128_gcm_indep = aead_indep<aes_128_gcm>;
 using chacha20_poly1305_indep = aead_indep<chacha20_poly1305>;
 
-template <typename Aead>
-struct aead_iter : public Aead {
-	static const size_t min_cap = Aead::tag_size + Aead::padding_size;
+// a fixed-width big-endian counter, used as the iv of consecutive records
+template <size_t N>
+class nonce_counter {
+	uint8_t m_bytes[N] = {};
 
-	aead_iter() = default;
-	aead_iter(const aead_iter &a) : m_enc_iv(BN_dup(a.m_enc_iv)), m_dec_iv(BN_dup(a.m_dec_iv)) {
-		memcpy(m_key, a.m_key, Aead::key_size);
-	}
-	aead_iter(aead_iter &&a) : m_enc_iv(a.m_enc_iv), m_dec_iv(a.m_dec_iv) {
-		memcpy(m_key, a.m_key, Aead::key_size);
-		a.m_enc_iv = a.m_dec_iv = nullptr;
+public:
+	constexpr nonce_counter() = default;
+	constexpr explicit nonce_counter(const uint8_t *iv) {
+		for (size_t i = 0; i < N; ++i) m_bytes[i] = iv[i];
 	}
 
-	aead_iter &operator=(const aead_iter &a) {
-		if (&a == this) return *this;
-		free();
-		memcpy(m_key, a.m_key, Aead::key_size);
-		m_enc_iv = BN_dup(a.m_enc_iv);
-		m_dec_iv = BN_dup(a.m_dec_iv);
-		return *this;
+	constexpr const uint8_t *data() const {
+		return m_bytes;
 	}
-	aead_iter &operator=(aead_iter &&a) {
-		if (&a == this) return *this;
-		free();
-		memcpy(m_key, a.m_key, Aead::key_size);
-		m_enc_iv = a.m_enc_iv;
-		m_dec_iv = a.m_dec_iv;
-		a.m_enc_iv = a.m_dec_iv = nullptr;
+
+	constexpr nonce_counter &operator++() {
+		for (size_t i = N; i-- > 0;) {
+			if (++m_bytes[i]) break;
+		}
 		return *this;
 	}
+};
+static_assert(std::is_trivially_copyable_v<nonce_counter<12>>, "nonce_counter is copied as plain bytes");
 
-	~aead_iter() {
-		free();
-	}
+template <typename Aead>
+struct aead_iter : public Aead {
+	static const size_t min_cap = Aead::tag_size + Aead::padding_size;
+
+	using nonce_type = nonce_counter<Aead::iv_size>;
 
 	void init(const uint8_t *key, const uint8_t *enc_iv, const uint8_t *dec_iv) {
-		if (key) memcpy(m_key, key, Aead::key_size);
-		if (enc_iv) m_enc_iv = BN_bin2bn(enc_iv, Aead::iv_size, nullptr);
-		if (dec_iv) m_dec_iv = BN_bin2bn(dec_iv, Aead::iv_size, nullptr);
+		if (key) Aead::set_key(key);
+		if (enc_iv) m_enc_iv = nonce_type(enc_iv), m_enc_ready = true;
+		if (dec_iv) m_dec_iv = nonce_type(dec_iv), m_dec_ready = true;
 	}
 
 	size_t encrypt(const uint8_t *data, size_t len, uint8_t *encrypted, size_t cap) {
 		thread_local static uint8_t tag[Aead::tag_size];
-		thread_local static uint8_t iv[Aead::iv_size];
 
 		if (cap < len + min_cap) throw std::runtime_error("cap is not large enough");
-		if (!m_enc_iv) throw std::runtime_error("encrypt iv has not been initialized");
+		if (!m_enc_ready) throw std::runtime_error("encrypt iv has not been initialized");
 
-		BN_bn2binpad(m_enc_iv, iv, Aead::iv_size);
-		BN_add_word(m_enc_iv, 1);
+		nonce_type iv = m_enc_iv;
+		++m_enc_iv;
 
-		size_t n = Aead::encrypt(m_key, iv, data, len, encrypted, cap - Aead::tag_size, tag);
+		size_t n = Aead::encrypt(iv.data(), data, len, encrypted, cap - Aead::tag_size, tag);
 		memcpy(encrypted + n, tag, Aead::tag_size);
 		return n + Aead::tag_size;
 	}
 	size_t decrypt(const uint8_t *data, size_t len, uint8_t *decrypted, size_t cap) {
 		thread_local static uint8_t tag[Aead::tag_size];
-		thread_local static uint8_t iv[Aead::iv_size];
 
-		if (!m_dec_iv) throw std::runtime_error("encrypt iv has not been initialized");
+		if (!m_dec_ready) throw std::runtime_error("decrypt iv has not been initialized");
 
-		BN_bn2binpad(m_dec_iv, iv, Aead::iv_size);
-		BN_add_word(m_dec_iv, 1);
+		nonce_type iv = m_dec_iv;
+		++m_dec_iv;
 
 		memcpy(tag, data + len - Aead::tag_size, Aead::tag_size);
-		return Aead::decrypt(m_key, iv, data, len - Aead::tag_size, decrypted, cap, tag);
+		return Aead::decrypt(iv.data(), data, len - Aead::tag_size, decrypted, cap, tag);
 	}
 
 private:
-	uint8_t m_key[Aead::key_size] = {};
-	BIGNUM *m_enc_iv = nullptr, *m_dec_iv = nullptr;
-
-	void free() {
-		BN_free(m_enc_iv), BN_free(m_dec_iv);
-	}
+	nonce_type m_enc_iv, m_dec_iv;
+	bool m_enc_ready = false, m_dec_ready = false;
 };
 
 using aes_128_gcm_iter = aead_iter<aes_128_gcm>;
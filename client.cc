@@ -1,4 +1,7 @@
+#include "client.h"
+
 #include <thread>
+#include <vector>
 #include <string>
 #include <memory>
 #include <chrono>
@@ -6,56 +9,247 @@
 #include <iostream>
 
 #include "tun.h"
+#include "vnet.h"
 #include "udp.h"
 #include "tcp.h"
 #include "utils.h"
 #include "session_mgr.h"
 #include "cipher.h"
+#include "poller.h"
+#if defined(__linux__)
+	#include "linux/uring.h"
+#endif
 
 using std::thread;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 using std::runtime_error;
 using std::cerr;
 using std::endl;
 
 typedef sudp4<chacha20_poly1305_indep> udp_type;
+typedef stcp4_conn<chacha20_poly1305_iter> tcp_type;
 
-static void client_tun2net(const tun_t *tun, udp_type *u, const addr_ipv4 *server) {
+// decrypted packets keep room in front for a vnet header
+static vector<packet_buf> make_packets(size_t n) {
 	const size_t buff_size = 4096;
-	unique_ptr<uint8_t[]> buff(new uint8_t[buff_size]);
+	vector<packet_buf> pkts;
+	pkts.reserve(n);
+	for (size_t i = 0; i < n; ++i)
+		pkts.emplace_back(sizeof(vnet_hdr) + udp_type::headroom, buff_size, udp_type::tailroom);
+	return pkts;
+}
+
+static size_t read_packets(const tun_t &tun, vnet_reader *reader, packet_buf *pkts, size_t n) {
+	return reader ? reader->read_batch(pkts, n) : tun_read_batch(tun, pkts, n);
+}
+
+static void write_packets(const tun_t &tun, vnet_writer *writer, packet_buf *pkts, size_t n) {
+	if (writer) {
+		writer->write_batch(pkts, n);
+		return;
+	}
+	for (size_t i = 0; i < n; ++i)
+		tun_write(tun, pkts[i].data(), pkts[i].size());
+}
+
+static void client_tun2net(const tun_t *tun, udp_type *u, const addr_ipv4 *server, const options *opts) {
+	const size_t batch = opts->batch;
+	vector<packet_buf> pkts = make_packets(batch);
+	vector<addr_ipv4> servers(batch, *server);
+	unique_ptr<vnet_reader> reader(opts->vnet ? new vnet_reader(*tun) : nullptr);
 	for (;;) {
 		try {
-			size_t size = tun_read(*tun, buff.get(), buff_size);
-			u->sendto(buff.get(), size, *server);
+			size_t n = read_packets(*tun, reader.get(), pkts.data(), batch);
+			u->send_batch(pkts.data(), servers.data(), n);
 		} catch (runtime_error e) {
 			cerr << "[error] client_tun2net " << e.what() << endl;
 		}
 	}
 }
 
-static void client_net2tun(const tun_t *tun, udp_type *u) {
-	const size_t buff_size = 4096;
-	unique_ptr<uint8_t[]> buff(new uint8_t[buff_size]);
+static void client_net2tun(const tun_t *tun, udp_type *u, const options *opts) {
+	const size_t batch = opts->batch;
+	vector<packet_buf> pkts = make_packets(batch);
+	vector<addr_ipv4> from(batch);
+	unique_ptr<vnet_writer> writer(opts->vnet ? new vnet_writer(*tun) : nullptr);
 	for (;;) {
 		try {
-			size_t size = u->recvfrom(buff.get(), buff_size);
-			tun_write(*tun, buff.get(), size);
+			size_t n = u->recv_batch(pkts.data(), from.data(), batch);
+			write_packets(*tun, writer.get(), pkts.data(), n);
 		} catch (runtime_error e) {
 			cerr << "[error] client_net2tun " << e.what() << endl;
 		}
 	}
 }
 
-void start_client(const string &server_addr) {
+#if defined(__linux__)
+enum class client_fd { tun, net };
+
+// nothing waits for the fds to become writable: a full socket drops the rest of a batch
+static bool on_writable(client_fd &) {
+	return false;
+}
+
+static bool on_tcp_writable(tcp_type *&conn) {
+	return conn && conn->on_writable();
+}
+
+// carries the tunnel over one tcp connection to the server, from one event loop
+static void client_tcp(const tun_t *tun, const addr_ipv4 *server, const options *opts) {
+	const size_t batch = opts->batch;
+	vector<packet_buf> pkts = make_packets(batch);
+
+	uint8_t key[] = "12345612345678901234561234567890";
+	tcp_type conn(tcp4_conn(*server), key);
+	set_nonblocking(conn.get_socket());
+	if (opts->zerocopy && !conn.set_zerocopy())
+		cerr << "[error] client_tcp zero-copy sends are not supported" << endl;
+
+	// edge-triggered: both fds are read until EAGAIN
+	event_poller<tcp_type *, on_tcp_writable> loop(true);
+	loop.add(*tun, nullptr);
+	loop.add(conn.get_socket(), &conn);
+
+	// a broken connection ends the client
+	for (;;) {
+		loop.wait(-1, [&](socket_t, tcp_type *c) {
+			if (c) {
+				// zero-copy completions come in as errors
+				conn.reap_zerocopy();
+				while (conn.receive([&](uint8_t *body, size_t n) {
+					for_each_ip_packet(body, n, [&](uint8_t *pkt, size_t size) {
+						tun_write(*tun, pkt, size);
+					});
+				}));
+				return;
+			}
+			size_t n;
+			do {
+				n = tun_try_read_batch(*tun, pkts.data(), batch);
+				for (size_t i = 0; i < n; ++i) {
+					try {
+						conn.queue(pkts[i].data(), pkts[i].size());
+					} catch (runtime_error &) {
+						// the write buffer is full: drop them, as a full queue would
+					}
+				}
+			} while (n == batch);
+			// what was read in this round goes out in as few records as fit
+			try {
+				conn.flush();
+			} catch (runtime_error &) {
+			}
+			if (conn.need_to_wait_write())
+				loop.wait_write(conn.get_socket());
+		});
+	}
+}
+
+// does the work of client_tun2net and client_net2tun on one thread: both fds
+// are non-blocking and drained in batches whenever the poller finds them readable
+static void client_loop(const tun_t *tun, udp_type *u, const addr_ipv4 *server, const options *opts) {
+	const size_t batch = opts->batch;
+	vector<packet_buf> pkts = make_packets(batch);
+	vector<addr_ipv4> servers(batch, *server), from(batch);
+
+	u->set_nonblocking();
+	event_poller<client_fd, on_writable> loop;
+	loop.add(*tun, client_fd::tun);
+	loop.add(u->get_socket(), client_fd::net);
+
+	for (;;) {
+		try {
+			loop.wait(-1, [&](socket_t, client_fd &fd) {
+				// a short batch means the fd is drained, or close enough that the next wait tells
+				size_t n;
+				if (fd == client_fd::tun) {
+					do {
+						n = tun_try_read_batch(*tun, pkts.data(), batch);
+						u->send_batch(pkts.data(), servers.data(), n);
+					} while (n == batch);
+				} else {
+					// segments of trains already received don't make the socket readable
+					do {
+						n = u->recv_batch(pkts.data(), from.data(), batch);
+						write_packets(*tun, nullptr, pkts.data(), n);
+					} while (n == batch || u->has_pending());
+				}
+			});
+		} catch (runtime_error e) {
+			cerr << "[error] client_loop " << e.what() << endl;
+		}
+	}
+}
+
+// does the work of client_tun2net and client_net2tun from one io_uring
+static void client_uring(const tun_t *tun, udp_type *u, const addr_ipv4 *server, const options *opts) {
+	struct handler {
+		udp_type *u;
+		const addr_ipv4 *server;
+
+		bool on_tun(packet_buf &p, addr_ipv4 &to) {
+			u->seal(p);
+			to = *server;
+			return true;
+		}
+		bool on_net(packet_buf &p, const addr_ipv4 &) {
+			try {
+				u->open(p);
+			} catch (runtime_error &) {
+				return false;
+			}
+			return true;
+		}
+		void on_tick() {}
+		void on_error(const string &what) {
+			cerr << "[error] client_uring " << what << endl;
+		}
+	} h{ u, server };
+
+	uring_tunnel<addr_ipv4> loop(*tun, u->get_socket(), opts->batch);
+	loop.run(h);
+}
+#endif
+
+void start_client(const string &server_addr, const options &opts) {
 	string name = "subtun";
-	tun_t tun = tun_alloc(name);
+	tun_t tun = opts.vnet ? tun_alloc_vnet(name, 1).front() : tun_alloc(name);
 	if (guess_addr_type(server_addr) == addr_type::ipv4) {
 		addr_ipv4 ad(server_addr);
+		if (opts.tcp) {
+#if defined(__linux__)
+			client_tcp(&tun, &ad, &opts);
+			return;
+#else
+			throw runtime_error("the tcp transport is only available on linux");
+#endif
+		}
+
 		udp_type udp;
 		udp.connect(ad);
-		thread t2n(client_tun2net, &tun, &udp, &ad),
-			   n2t(client_net2tun, &tun, &udp);
+		if (opts.offload && !udp.enable_offload())
+			cerr << "[warning] udp segmentation offload is not available" << endl;
+		if (opts.uring) {
+#if defined(__linux__)
+			client_uring(&tun, &udp, &ad, &opts);
+			return;
+#else
+			throw runtime_error("io_uring is only available on linux");
+#endif
+		}
+		if (opts.loop) {
+#if defined(__linux__)
+			client_loop(&tun, &udp, &ad, &opts);
+			return;
+#else
+			throw runtime_error("the event loop is only available on linux");
+#endif
+		}
+
+		thread t2n(client_tun2net, &tun, &udp, &ad, &opts),
+			   n2t(client_net2tun, &tun, &udp, &opts);
 
 		t2n.join(), n2t.join();
 	} else {
@@ -2,4 +2,6 @@
 
 #include <string>
 
-void start_client(const std::string &server_addr);
+#include "options.h"
+
+void start_client(const std::string &server_addr, const options &opts);
@@ -1,11 +1,13 @@
 #pragma once
 
-#include <functional>
+#include <utility>
 #include <vector>
 #include <algorithm>
 #include <stdexcept>
+#include <cerrno>
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 #include "../socket.h"
@@ -24,16 +26,24 @@ class epoll {
 
 	using efd_t = movable_fd<int, decltype(close), close, -1>;
 	efd_t m_efd;
+	// EPOLLET in edge-triggered mode, or'ed into every registration
+	uint32_t m_trigger;
 	std::vector<struct epoll_event> m_events;
 	std::vector<entry*> m_fd_data;
 
+	static constexpr size_t max_events = 4096;
+
 public:
 	enum event_types {
 		EV_READ = EPOLLIN,
 		EV_WRITE = EPOLLOUT,
+		// always reported, whether asked for or not
+		EV_ERROR = EPOLLERR | EPOLLHUP,
 	};
 
-	epoll();
+	// an edge-triggered epoll only reports fds that became ready, so they must
+	// be read, and written, until EAGAIN each time
+	explicit epoll(bool edge_triggered = false);
 	epoll(const epoll &) = delete;
 	epoll &operator=(const epoll &) = delete;
 	epoll(epoll &&) = default;
@@ -46,11 +56,16 @@ public:
 	void set(socket_t sock, event_types event);
 	void unset(socket_t sock, event_types event);
 	void del(socket_t sock);
-	void wait(int timeout, const std::function<void(socket_t, uint32_t, Data&)> &f);
+	// the data sock was added with, or nullptr if it isn't in the epoll
+	Data *get(socket_t sock);
+	// calls f(socket_t, uint32_t events, Data &) for every ready fd
+	template <typename F>
+	void wait(int timeout, F &&f);
 };
 
 template <typename Data>
-epoll<Data>::epoll() : m_efd(epoll_create1(0)), m_events(64) {
+epoll<Data>::epoll(bool edge_triggered) :
+	m_efd(epoll_create1(0)), m_trigger(edge_triggered ? static_cast<uint32_t>(EPOLLET) : 0u), m_events(64) {
 	if (m_efd <= 0) {
 		throw std::runtime_error("fail to create an epoll fd");
 	}
@@ -59,12 +74,14 @@ epoll<Data>::epoll() : m_efd(epoll_create1(0)), m_events(64) {
 template <typename Data>
 epoll<Data> &epoll<Data>::operator=(epoll &&e) {
 	if (&e == this) return *this;
-	for (entry *&e : m_fd_data) {
-		if (e) delete e;
+	for (entry *&d : m_fd_data) {
+		if (d) delete d;
 	}
-	m_efd = e.m_efd;
+	m_efd = std::move(e.m_efd);
+	m_trigger = e.m_trigger;
 	m_events = std::move(e.m_events);
 	m_fd_data = std::move(e.m_fd_data);
+	return *this;
 }
 
 template <typename Data>
@@ -86,7 +103,8 @@ void epoll<Data>::add(socket_t sock, Args && ...args) {
 
 	struct epoll_event ev;
 	ev.data.ptr = e;
-	ev.events = e->events = EPOLLERR;
+	e->events = EPOLLERR;
+	ev.events = e->events | m_trigger;
 	epoll_ctl(m_efd, EPOLL_CTL_ADD, sock, &ev);
 }
 
@@ -99,7 +117,8 @@ void epoll<Data>::set(socket_t sock, event_types event) {
 
 	struct epoll_event ev;
 	ev.data.ptr = e;
-	ev.events = e->events |= event;
+	e->events |= event;
+	ev.events = e->events | m_trigger;
 	epoll_ctl(m_efd, EPOLL_CTL_MOD, sock, &ev);
 }
 
@@ -112,7 +131,8 @@ void epoll<Data>::unset(socket_t sock, event_types event) {
 
 	struct epoll_event ev;
 	ev.data.ptr = e;
-	ev.events = e->events &= ~static_cast<uint32_t>(event);
+	e->events &= ~static_cast<uint32_t>(event);
+	ev.events = e->events | m_trigger;
 	epoll_ctl(m_efd, EPOLL_CTL_MOD, sock, &ev);
 }
 
@@ -128,13 +148,54 @@ void epoll<Data>::del(socket_t sock) {
 }
 
 template <typename Data>
-void epoll<Data>::wait(int timeout, const std::function<void(socket_t, uint32_t, Data&)> &f) {
+Data *epoll<Data>::get(socket_t sock) {
+	if (sock < 0 || static_cast<size_t>(sock) >= m_fd_data.size() || !m_fd_data[sock])
+		return nullptr;
+	return &m_fd_data[sock]->data;
+}
+
+template <typename Data>
+template <typename F>
+void epoll<Data>::wait(int timeout, F &&f) {
 	int n = epoll_wait(m_efd, m_events.data(), m_events.size(), timeout);
 	if (n < 0) {
+		if (errno == EINTR) return;
 		throw std::runtime_error("epoll_wait fails");
 	}
 	for (int i = 0; i < n; ++i) {
 		entry *e = static_cast<entry*>(m_events[i].data.ptr);
-		f(e->fd, e->data, m_events[i].events);
+		f(e->fd, m_events[i].events, e->data);
 	}
+	// a full array may have left ready fds for the next wait; take more at once from now on
+	if (static_cast<size_t>(n) == m_events.size() && m_events.size() < max_events)
+		m_events.resize(m_events.size() * 2);
 }
+
+// an eventfd for other threads to wake up a thread waiting in epoll
+class waker {
+	using efd_t = movable_fd<int, decltype(close), close, -1>;
+	efd_t m_fd;
+
+public:
+	waker() : m_fd(eventfd(0, EFD_NONBLOCK)) {
+		if (m_fd < 0)
+			throw std::runtime_error("fail to create an eventfd");
+	}
+
+	int get_fd() const {
+		return m_fd;
+	}
+
+	void wake() {
+		uint64_t one = 1;
+		if (::write(m_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			throw std::runtime_error("fail to write the eventfd");
+	}
+
+	// resets it once the wakeup is taken
+	void clear() {
+		uint64_t n;
+		if (::read(m_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+			throw std::runtime_error("fail to read the eventfd");
+	}
+};
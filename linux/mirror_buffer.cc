@@ -0,0 +1,60 @@
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <initializer_list>
+
+#include "../mirror_buffer.h"
+
+using std::string;
+using std::runtime_error;
+
+// a memfd of the capacity, mapped at both halves of a reservation twice its size
+mirror_buffer::mirror_buffer(size_t n) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	m_capacity = (n + page - 1) / page * page;
+
+	int fd = memfd_create("subtun-ring", MFD_CLOEXEC);
+	if (fd < 0)
+		throw runtime_error(string("mirror_buffer: memfd_create returns err ") + strerror(errno));
+	if (ftruncate(fd, m_capacity) < 0) {
+		int err = errno;
+		close(fd);
+		throw runtime_error(string("mirror_buffer: ftruncate returns err ") + strerror(err));
+	}
+
+	void *p = mmap(nullptr, m_capacity * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		int err = errno;
+		close(fd);
+		throw runtime_error(string("mirror_buffer: mmap returns err ") + strerror(err));
+	}
+	uint8_t *base = static_cast<uint8_t *>(p);
+	for (uint8_t *half : { base, base + m_capacity }) {
+		if (mmap(half, m_capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+			int err = errno;
+			munmap(base, m_capacity * 2);
+			close(fd);
+			throw runtime_error(string("mirror_buffer: mmap returns err ") + strerror(err));
+		}
+	}
+	// the mappings keep the memory
+	close(fd);
+	m_base = base;
+}
+
+mirror_buffer &mirror_buffer::operator=(mirror_buffer &&b) {
+	if (&b == this) return *this;
+	if (m_base) munmap(m_base, m_capacity * 2);
+	m_base = b.m_base, m_capacity = b.m_capacity, m_head = b.m_head, m_size = b.m_size;
+	b.m_base = nullptr;
+	b.m_capacity = b.m_head = b.m_size = 0;
+	return *this;
+}
+
+mirror_buffer::~mirror_buffer() {
+	if (m_base) munmap(m_base, m_capacity * 2);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../addr.h"
+
+// conversions between our addresses and the socket api's
+
+inline void set_sockaddr_in(struct sockaddr_in &saddr, const addr_ipv4 &ad) {
+	saddr.sin_family = AF_INET;
+	ad.copy_ip(&saddr.sin_addr.s_addr);
+	saddr.sin_port = htons(ad.port());
+}
+
+inline void set_sockaddr_in6(struct sockaddr_in6 &saddr, const addr_ipv6 &ad) {
+	saddr.sin6_family = AF_INET6;
+	ad.copy_ip(&saddr.sin6_addr.s6_addr);
+	saddr.sin6_port = htons(ad.port());
+	//saddr.sin6_scope_id
+}
+
+inline bool get_sockaddr(const struct sockaddr_in &saddr, addr_ipv4 &ad) {
+	if (saddr.sin_family != AF_INET) return false;
+	ad.set_ip(&saddr.sin_addr.s_addr);
+	ad.set_port(ntohs(saddr.sin_port));
+	return true;
+}
+
+inline bool get_sockaddr(const struct sockaddr_in6 &saddr, addr_ipv6 &ad) {
+	if (saddr.sin6_family != AF_INET6) return false;
+	ad.set_ip(&saddr.sin6_addr.s6_addr);
+	ad.set_port(ntohs(saddr.sin6_port));
+	return true;
+}
+
+inline void set_sockaddr(struct sockaddr_in &saddr, const addr_ipv4 &ad) {
+	set_sockaddr_in(saddr, ad);
+}
+
+inline void set_sockaddr(struct sockaddr_in6 &saddr, const addr_ipv6 &ad) {
+	set_sockaddr_in6(saddr, ad);
+}
+
+template <typename Addr>
+struct sockaddr_of;
+
+template <>
+struct sockaddr_of<addr_ipv4> {
+	using type = struct sockaddr_in;
+};
+
+template <>
+struct sockaddr_of<addr_ipv6> {
+	using type = struct sockaddr_in6;
+};
@@ -1,33 +1,29 @@
 #include <stdexcept>
 #include <string>
+#include <algorithm>
+#include <chrono>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <linux/errqueue.h>
 #include <cstring>
+#include <cerrno>
+#include <cstdint>
 
 #include "../socket.h"
+#include "sockaddr.h"
 
 using std::runtime_error;
 using std::string;
 
 const socket_t socket_invalid = -1;
 
-static void set_sockaddr_in(struct sockaddr_in &saddr, const addr_ipv4 &ad) {
-	saddr.sin_family = AF_INET;
-	ad.copy_ip(&saddr.sin_addr.s_addr);
-	saddr.sin_port = htons(ad.port());
-}
-
-static void set_sockaddr_in6(struct sockaddr_in6 &saddr, const addr_ipv6 &ad) {
-	saddr.sin6_family = AF_INET6;
-	ad.copy_ip(&saddr.sin6_addr.s6_addr);
-	saddr.sin6_port = htons(ad.port());
-	//saddr.sin6_scope_id
-}
-
 socket_t make_udp4(const addr_ipv4 &ad) {
 	int fd = socket(PF_INET, SOCK_DGRAM, 0);
 
@@ -50,6 +46,68 @@ socket_t make_udp6(const addr_ipv6 &ad) {
 	return fd;
 }
 
+template <typename SockAddr, typename Addr>
+static socket_t make_shared(int family, int type, const Addr &ad, const char *who) {
+	int fd = socket(family, type, 0);
+	if (fd < 0)
+		throw runtime_error(string(who) + ": socket returns err " + strerror(errno));
+
+	int on = 1;
+	SockAddr saddr {};
+	set_sockaddr(saddr, ad);
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0
+		|| bind(fd, reinterpret_cast<struct sockaddr *>(&saddr), sizeof(saddr)) != 0) {
+		int err = errno;
+		close(fd);
+		throw runtime_error(string(who) + ": fail to bind `" + ad.to_string() + "'. err " + strerror(err));
+	}
+	return fd;
+}
+
+socket_t make_shared_udp4(const addr_ipv4 &ad) {
+	return make_shared<struct sockaddr_in>(PF_INET, SOCK_DGRAM, ad, "make_shared_udp");
+}
+
+socket_t make_shared_udp6(const addr_ipv6 &ad) {
+	return make_shared<struct sockaddr_in6>(PF_INET6, SOCK_DGRAM, ad, "make_shared_udp");
+}
+
+socket_t make_shared_tcp4(const addr_ipv4 &ad) {
+	return make_shared<struct sockaddr_in>(PF_INET, SOCK_STREAM, ad, "make_shared_tcp");
+}
+
+socket_t make_shared_tcp6(const addr_ipv6 &ad) {
+	return make_shared<struct sockaddr_in6>(PF_INET6, SOCK_STREAM, ad, "make_shared_tcp");
+}
+
+// a classic bpf program run for every datagram the group receives. it hashes
+// the 32-bit word at src_off of the ip header and returns the index of the
+// socket to deliver to; sockets are numbered in the order they were bound.
+static void attach_steering(const socket_t &sock, uint32_t src_off, size_t n) {
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + src_off),
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(n)),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog {};
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0)
+		throw runtime_error(string("steer_by_source: setsockopt returns err ") + strerror(errno));
+}
+
+void steer_by_source4(const socket_t &sock, size_t n) {
+	// the source address
+	attach_steering(sock, 12, n);
+}
+
+void steer_by_source6(const socket_t &sock, size_t n) {
+	// the last word of the source address
+	attach_steering(sock, 20, n);
+}
+
 size_t receive_from_socket4(const socket_t &sock, void *buf, size_t len, addr_ipv4 &ad) {
 	ssize_t size;
 	struct sockaddr_in saddr {};
@@ -99,12 +157,278 @@ size_t send_to_socket6(const socket_t &sock, const void *buf, size_t len, const
 	return size;
 }
 
+template <typename SockAddr, typename Addr>
+static size_t receive_batch(const socket_t &sock, datagram<Addr> *dgrams, size_t n, bool segmented = false) {
+	struct mmsghdr msgs[max_batch] {};
+	struct iovec iovs[max_batch];
+	SockAddr saddrs[max_batch];
+	alignas(struct cmsghdr) char controls[max_batch][CMSG_SPACE(sizeof(int))];
+
+	n = std::min(n, max_batch);
+	for (size_t i = 0; i < n; ++i) {
+		iovs[i].iov_base = dgrams[i].buf;
+		iovs[i].iov_len = dgrams[i].len;
+		msgs[i].msg_hdr.msg_iov = iovs + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = saddrs + i;
+		msgs[i].msg_hdr.msg_namelen = sizeof(SockAddr);
+		if (segmented) {
+			msgs[i].msg_hdr.msg_control = controls[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+		}
+	}
+
+	// block for the first datagram only, then take whatever else is queued
+	int m = recvmmsg(sock, msgs, n, MSG_WAITFORONE, nullptr);
+	if (m < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (m < 0)
+		throw runtime_error(string("receive_batch_from_socket: recvmmsg returns err ") + strerror(errno));
+
+	for (int i = 0; i < m; ++i) {
+		if (!get_sockaddr(saddrs[i], dgrams[i].addr))
+			throw runtime_error("receive_batch_from_socket: src address family mismatch");
+		dgrams[i].len = msgs[i].msg_len;
+		dgrams[i].segment = msgs[i].msg_len;
+		if (!segmented) continue;
+
+		// gro tells the size of the datagrams it coalesced
+		struct msghdr &h = msgs[i].msg_hdr;
+		for (struct cmsghdr *c = CMSG_FIRSTHDR(&h); c; c = CMSG_NXTHDR(&h, c)) {
+			if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+				int size;
+				memcpy(&size, CMSG_DATA(c), sizeof(size));
+				dgrams[i].segment = size;
+			}
+		}
+	}
+	return m;
+}
+
+template <typename SockAddr, typename Addr>
+static size_t send_batch(const socket_t &sock, const datagram<Addr> *dgrams, size_t n) {
+	struct mmsghdr msgs[max_batch] {};
+	struct iovec iovs[max_batch];
+	SockAddr saddrs[max_batch] {};
+
+	size_t sent = 0;
+	while (sent < n) {
+		size_t k = std::min(n - sent, max_batch);
+		for (size_t i = 0; i < k; ++i) {
+			const datagram<Addr> &d = dgrams[sent + i];
+			set_sockaddr(saddrs[i], d.addr);
+			iovs[i].iov_base = d.buf;
+			iovs[i].iov_len = d.len;
+			msgs[i].msg_hdr.msg_iov = iovs + i;
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = saddrs + i;
+			msgs[i].msg_hdr.msg_namelen = sizeof(SockAddr);
+		}
+
+		int m = sendmmsg(sock, msgs, k, 0);
+		if (m < 0 && errno == EAGAIN)
+			break;
+		if (m < 0)
+			throw runtime_error(string("send_batch_to_socket: sendmmsg returns err ") + strerror(errno));
+		sent += m;
+	}
+	return sent;
+}
+
+// the largest datagram each destination takes in a gso send. gso can't
+// fragment, so segments that don't fit the path mtu are refused with
+// EMSGSIZE, and datagrams that large are then sent one by one to that
+// destination, and fragmented as usual. it is a small per-thread cache
+// indexed by address: a destination evicted by another, or whose entry has
+// expired, is learned again by one refused send. entries expire so that a
+// path whose mtu has gone up gets whole trains again.
+template <typename Addr>
+class segment_caps {
+	static constexpr size_t slots = 256;
+	// seconds, the kernel's default for a learned path mtu
+	static constexpr int64_t lifetime = 600;
+
+	struct slot {
+		Addr addr;
+		size_t cap = SIZE_MAX;
+		int64_t until = 0;
+	};
+	slot m_slots[slots];
+
+	static int64_t now() {
+		using namespace std::chrono;
+		return duration_cast<seconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	slot &at(const Addr &ad) {
+		return m_slots[typename Addr::hash()(ad) % slots];
+	}
+
+public:
+	size_t get(const Addr &ad) {
+		slot &s = at(ad);
+		if (s.cap == SIZE_MAX || s.addr != ad) return SIZE_MAX;
+		// the clock is only read for destinations with a cap
+		if (now() >= s.until) s.cap = SIZE_MAX;
+		return s.cap;
+	}
+
+	void lower(const Addr &ad, size_t cap) {
+		slot &s = at(ad);
+		if (s.addr != ad || s.cap == SIZE_MAX) {
+			s.addr = ad;
+			s.cap = cap;
+		} else {
+			s.cap = std::min(s.cap, cap);
+		}
+		s.until = now() + lifetime;
+	}
+};
+
+// sends each run of datagrams that go to the same address and have the same
+// size (the last may be shorter) as one message: the iovecs are laid end to
+// end and UDP_SEGMENT has the kernel, or the nic, cut them apart again.
+template <typename SockAddr, typename Addr>
+static size_t send_segmented_batch(const socket_t &sock, const datagram<Addr> *dgrams, size_t n) {
+	// the kernel's UDP_MAX_SEGMENTS, and what fits in one ip packet with room for the headers
+	constexpr size_t max_segments = 64, max_payload = max_train - 128;
+	thread_local static segment_caps<Addr> caps;
+
+	struct mmsghdr msgs[max_batch] {};
+	struct iovec iovs[max_batch];
+	SockAddr saddrs[max_batch] {};
+	alignas(struct cmsghdr) char controls[max_batch][CMSG_SPACE(sizeof(uint16_t))] {};
+	size_t counts[max_batch];
+	const datagram<Addr> *firsts[max_batch];
+
+	size_t sent = 0;
+	while (sent < n) {
+		size_t k = std::min(n - sent, max_batch), m = 0;
+		for (size_t i = 0; i < k; ) {
+			const datagram<Addr> &first = dgrams[sent + i];
+			size_t j = i + 1, total = first.len;
+			const size_t too_large = caps.get(first.addr);
+			while (j < k && j - i < max_segments && first.len < too_large) {
+				const datagram<Addr> &d = dgrams[sent + j];
+				if (d.len > first.len || d.addr != first.addr || total + d.len > max_payload)
+					break;
+				total += d.len;
+				++j;
+				if (d.len < first.len) break;
+			}
+
+			for (size_t t = i; t < j; ++t) {
+				iovs[t].iov_base = dgrams[sent + t].buf;
+				iovs[t].iov_len = dgrams[sent + t].len;
+			}
+			struct msghdr &h = msgs[m].msg_hdr;
+			set_sockaddr(saddrs[m], first.addr);
+			h.msg_name = saddrs + m;
+			h.msg_namelen = sizeof(SockAddr);
+			h.msg_iov = iovs + i;
+			h.msg_iovlen = j - i;
+			h.msg_control = nullptr;
+			h.msg_controllen = 0;
+			if (j - i > 1) {
+				h.msg_control = controls[m];
+				h.msg_controllen = sizeof(controls[m]);
+				struct cmsghdr *c = CMSG_FIRSTHDR(&h);
+				c->cmsg_level = SOL_UDP;
+				c->cmsg_type = UDP_SEGMENT;
+				c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				uint16_t size = first.len;
+				memcpy(CMSG_DATA(c), &size, sizeof(size));
+			}
+			firsts[m] = &first;
+			counts[m++] = j - i;
+			i = j;
+		}
+
+		for (size_t done = 0; done < m; ) {
+			int r = sendmmsg(sock, msgs + done, m - done, 0);
+			if (r < 0 && errno == EMSGSIZE && counts[done] > 1) {
+				struct msghdr &h = msgs[done].msg_hdr;
+				caps.lower(firsts[done]->addr, h.msg_iov[0].iov_len);
+				for (size_t t = 0; t < counts[done]; ++t) {
+					struct msghdr single = h;
+					single.msg_iov = h.msg_iov + t;
+					single.msg_iovlen = 1;
+					single.msg_control = nullptr;
+					single.msg_controllen = 0;
+					if (sendmsg(sock, &single, 0) < 0)
+						throw runtime_error(string("send_segmented_batch_to_socket: sendmsg returns err ") + strerror(errno));
+				}
+				r = 1;
+			} else if (r < 0 && errno == EAGAIN) {
+				return sent;
+			} else if (r < 0) {
+				throw runtime_error(string("send_segmented_batch_to_socket: sendmmsg returns err ") + strerror(errno));
+			}
+			for (int i = 0; i < r; ++i)
+				sent += counts[done + i];
+			done += r;
+		}
+	}
+	return sent;
+}
+
+bool enable_udp_offload(const socket_t &sock) {
+	int on = 1;
+	return setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+}
+
+size_t receive_segmented_batch_from_socket4(const socket_t &sock, datagram<addr_ipv4> *dgrams, size_t n) {
+	return receive_batch<struct sockaddr_in>(sock, dgrams, n, true);
+}
+
+size_t receive_segmented_batch_from_socket6(const socket_t &sock, datagram<addr_ipv6> *dgrams, size_t n) {
+	return receive_batch<struct sockaddr_in6>(sock, dgrams, n, true);
+}
+
+size_t send_segmented_batch_to_socket4(const socket_t &sock, const datagram<addr_ipv4> *dgrams, size_t n) {
+	return send_segmented_batch<struct sockaddr_in>(sock, dgrams, n);
+}
+
+size_t send_segmented_batch_to_socket6(const socket_t &sock, const datagram<addr_ipv6> *dgrams, size_t n) {
+	return send_segmented_batch<struct sockaddr_in6>(sock, dgrams, n);
+}
+
+size_t receive_batch_from_socket4(const socket_t &sock, datagram<addr_ipv4> *dgrams, size_t n) {
+	return receive_batch<struct sockaddr_in>(sock, dgrams, n);
+}
+
+size_t receive_batch_from_socket6(const socket_t &sock, datagram<addr_ipv6> *dgrams, size_t n) {
+	return receive_batch<struct sockaddr_in6>(sock, dgrams, n);
+}
+
+size_t send_batch_to_socket4(const socket_t &sock, const datagram<addr_ipv4> *dgrams, size_t n) {
+	return send_batch<struct sockaddr_in>(sock, dgrams, n);
+}
+
+size_t send_batch_to_socket6(const socket_t &sock, const datagram<addr_ipv6> *dgrams, size_t n) {
+	return send_batch<struct sockaddr_in6>(sock, dgrams, n);
+}
+
 void close_socket(socket_t &sock) {
 	if (sock == socket_invalid) return;
 	close(sock);
 	sock = socket_invalid;
 }
 
+void set_receive_timeout(const socket_t &sock, int ms) {
+	struct timeval tv {};
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = ms % 1000 * 1000;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+		throw runtime_error(string("set_receive_timeout: setsockopt returns err ") + strerror(errno));
+}
+
+void set_nonblocking(const socket_t &sock) {
+	int flags = fcntl(sock, F_GETFL);
+	if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+		throw runtime_error(string("set_nonblocking: fcntl returns err ") + strerror(errno));
+}
+
 void connect4(const size_t &sock, const addr_ipv4 &ad) {
 	struct sockaddr_in saddr{};
 	set_sockaddr_in(saddr, ad);
@@ -148,11 +472,19 @@ void listen_tcp(const socket_t &sock) {
 socket_t accept_tcp4(const socket_t &sock, addr_ipv4 &ad) {
 	struct sockaddr_in saddr {};
 	socklen_t as = sizeof(saddr);
-	int fd = accept(fd, reinterpret_cast<struct sockaddr *>(&saddr), &as);
+	int fd;
+	// a connection reset while it was pending is skipped, not reported
+	do {
+		fd = accept(sock, reinterpret_cast<struct sockaddr *>(&saddr), &as);
+	} while (fd < 0 && (errno == ECONNABORTED || errno == EINTR));
+	if (fd < 0 && errno == EAGAIN)
+		return socket_invalid;
 	if (fd < 0)
-		throw runtime_error("fail to accept");
-	if (saddr.sin_family != AF_INET)
+		throw runtime_error(string("accept_tcp4: accept returns err ") + strerror(errno));
+	if (saddr.sin_family != AF_INET) {
+		close(fd);
 		throw runtime_error("accept_tcp4: src is not ipv4");
+	}
 	ad.set_ip(&saddr.sin_addr.s_addr);
 	ad.set_port(ntohs(saddr.sin_port));
 	return fd;
@@ -160,11 +492,19 @@ socket_t accept_tcp4(const socket_t &sock, addr_ipv4 &ad) {
 socket_t accept_tcp6(const socket_t &sock, addr_ipv6 &ad) {
 	struct sockaddr_in6 saddr {};
 	socklen_t as = sizeof(saddr);
-	int fd = accept(fd, reinterpret_cast<struct sockaddr *>(&saddr), &as);
+	int fd;
+	// a connection reset while it was pending is skipped, not reported
+	do {
+		fd = accept(sock, reinterpret_cast<struct sockaddr *>(&saddr), &as);
+	} while (fd < 0 && (errno == ECONNABORTED || errno == EINTR));
+	if (fd < 0 && errno == EAGAIN)
+		return socket_invalid;
 	if (fd < 0)
-		throw runtime_error("fail to accept");
-	if (saddr.sin6_family != AF_INET6)
+		throw runtime_error(string("accept_tcp6: accept returns err ") + strerror(errno));
+	if (saddr.sin6_family != AF_INET6) {
+		close(fd);
 		throw runtime_error("accept_tcp6: src is not ipv6");
+	}
 	ad.set_ip(&saddr.sin6_addr.s6_addr);
 	ad.set_port(ntohs(saddr.sin6_port));
 	return fd;
@@ -177,15 +517,78 @@ size_t receive_socket(const socket_t &sock, void *buf, size_t len) {
 			throw runtime_error("socket disconnected");
 		if (errno != EAGAIN)
 			throw runtime_error("fail to receive socket");
+		return 0;
 	}
 	return size;
 }
 size_t send_socket(const socket_t &sock, const void *buf, size_t len) {
 	ssize_t size;
-	if (size = send(sock, buf, len, 0); size < 0) {
+	if (size = send(sock, buf, len, MSG_NOSIGNAL); size < 0) {
+		if (errno != EAGAIN)
+			throw runtime_error("fail to send socket");
+		return 0;
+	}
+	return size;
+}
+
+size_t send_socket_gather(const socket_t &sock, const io_slice *slices, size_t n, bool *zerocopy) {
+	constexpr size_t max_slices = 8;
+	struct iovec iovs[max_slices];
+	n = std::min(n, max_slices);
+	for (size_t i = 0; i < n; ++i) {
+		iovs[i].iov_base = const_cast<void *>(slices[i].buf);
+		iovs[i].iov_len = slices[i].len;
+	}
+	struct msghdr msg {};
+	msg.msg_iov = iovs;
+	msg.msg_iovlen = n;
+
+	ssize_t size = -1;
+	bool zc = zerocopy && *zerocopy;
+	if (zc && (size = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY)) < 0 && errno == ENOBUFS) {
+		// out of option memory for the notification: copy this one
+		zc = *zerocopy = false;
+	}
+	if (!zc)
+		size = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	if (size < 0) {
 		if (errno != EAGAIN)
 			throw runtime_error("fail to send socket");
 		return 0;
 	}
 	return size;
 }
+
+bool enable_zerocopy(const socket_t &sock) {
+	int on = 1;
+	return setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+}
+
+bool read_zerocopy_completion(const socket_t &sock, uint32_t &lo, uint32_t &hi, bool &copied) {
+	uint8_t control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+	struct msghdr msg {};
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	for (;;) {
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno != EAGAIN)
+				throw runtime_error(string("read_zerocopy_completion: recvmsg returns err ") + strerror(errno));
+			return false;
+		}
+		for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			if (!((c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR)
+				|| (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR)))
+				continue;
+			struct sock_extended_err err;
+			memcpy(&err, CMSG_DATA(c), sizeof(err));
+			if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+				continue;
+			lo = err.ee_info, hi = err.ee_data;
+			copied = err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+			return true;
+		}
+		// something else was queued; look at the next one
+		msg.msg_controllen = sizeof(control);
+	}
+}
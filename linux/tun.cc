@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -9,26 +10,25 @@
 
 #include <stdexcept>
 #include <string>
+#include <vector>
 #include <algorithm>
 
 #include "../tun.h"
+#include "../vnet.h"
 
 using std::string;
 using std::runtime_error;
+using std::vector;
 
-tun_t tun_alloc(string &name) {
-	if (name.size() >= IFNAMSIZ) {
-		throw runtime_error("name is too long");
-	}
-
-	int fd = open("/dev/net/tun", O_RDWR);
+static tun_t tun_open(string &name, short flags) {
+	int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
 	if (fd < 0) {
 		throw runtime_error(string("open /dev/net/tun fail. errno: ") + strerror(errno));
 	}
-	
+
 	struct ifreq ifr {};
 	std::copy(name.begin(), name.end(), ifr.ifr_name);
-	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	ifr.ifr_flags = flags;
 
 	if (int err = ioctl(fd, TUNSETIFF, &ifr); err < 0) {
 		close(fd);
@@ -39,11 +39,113 @@ tun_t tun_alloc(string &name) {
 	return fd;
 }
 
+tun_t tun_alloc(string &name) {
+	if (name.size() >= IFNAMSIZ) {
+		throw runtime_error("name is too long");
+	}
+	return tun_open(name, IFF_TUN | IFF_NO_PI);
+}
+
+static vector<tun_t> tun_open_queues(string &name, size_t queues, short flags) {
+	if (name.size() >= IFNAMSIZ) {
+		throw runtime_error("name is too long");
+	}
+	if (queues > 1) {
+		flags |= IFF_MULTI_QUEUE;
+	}
+
+	// every queue attaches to the same interface; the kernel then steers each flow to one of them
+	vector<tun_t> ans;
+	try {
+		for (size_t i = 0; i < queues; ++i) {
+			ans.push_back(tun_open(name, flags));
+		}
+	} catch (runtime_error &) {
+		for (tun_t fd : ans) close(fd);
+		throw;
+	}
+	return ans;
+}
+
+vector<tun_t> tun_alloc(string &name, size_t queues) {
+	return tun_open_queues(name, queues, IFF_TUN | IFF_NO_PI);
+}
+
+vector<tun_t> tun_alloc_vnet(string &name, size_t queues) {
+	vector<tun_t> ans = tun_open_queues(name, queues, IFF_TUN | IFF_NO_PI | IFF_VNET_HDR);
+
+	// lets the stack hand over unchecksummed tcp super-packets instead of
+	// segmenting them down to the mtu first
+	int hdr_size = sizeof(vnet_hdr);
+	unsigned offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+	for (tun_t fd : ans) {
+		if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_size) < 0 || ioctl(fd, TUNSETOFFLOAD, offload) < 0) {
+			string err = strerror(errno);
+			for (tun_t t : ans) close(t);
+			throw runtime_error("enable tun offload fail. errno: " + err);
+		}
+	}
+	return ans;
+}
+
+static void tun_wait_readable(const tun_t &tun) {
+	struct pollfd pfd {};
+	pfd.fd = tun;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		throw runtime_error(string("tun_read: poll returns err. errno: ") + strerror(errno));
+}
+
 size_t tun_read(const tun_t& tun, void *buf, size_t len) {
+	for (;;) {
+		ssize_t size = read(tun, buf, len);
+		if (size >= 0)
+			return size;
+		if (errno != EAGAIN)
+			throw runtime_error(string("tun_read: read returns err. errno: ") + strerror(errno));
+		tun_wait_readable(tun);
+	}
+}
+
+size_t tun_try_read(const tun_t &tun, void *buf, size_t len) {
 	ssize_t size = read(tun, buf, len);
-	if (size < 0)
+	if (size >= 0)
+		return size;
+	if (errno != EAGAIN)
 		throw runtime_error(string("tun_read: read returns err. errno: ") + strerror(errno));
-	return size;
+	return 0;
+}
+
+size_t tun_read_batch(const tun_t &tun, packet_buf *pkts, size_t n) {
+	if (n == 0) return 0;
+	pkts[0].reset();
+	pkts[0].resize(tun_read(tun, pkts[0].data(), pkts[0].capacity()));
+
+	size_t i = 1;
+	for (; i < n; ++i) {
+		packet_buf &p = pkts[i];
+		p.reset();
+		ssize_t size = read(tun, p.data(), p.capacity());
+		if (size < 0) {
+			if (errno != EAGAIN)
+				throw runtime_error(string("tun_read: read returns err. errno: ") + strerror(errno));
+			break;
+		}
+		p.resize(size);
+	}
+	return i;
+}
+
+size_t tun_try_read_batch(const tun_t &tun, packet_buf *pkts, size_t n) {
+	size_t i = 0;
+	for (; i < n; ++i) {
+		packet_buf &p = pkts[i];
+		p.reset();
+		size_t size = tun_try_read(tun, p.data(), p.capacity());
+		if (size == 0) break;
+		p.resize(size);
+	}
+	return i;
 }
 
 size_t tun_write(const tun_t& tun, const void* buf, size_t len) {
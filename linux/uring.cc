@@ -0,0 +1,145 @@
+#include "uring.h"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+using std::runtime_error;
+using std::string;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+	void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	if (p == MAP_FAILED)
+		throw runtime_error(string("uring: mmap returns err ") + strerror(errno));
+	return p;
+}
+
+uring::uring(unsigned entries) {
+	// only this thread submits, and completions can wait until it enters the kernel
+	m_params.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+	if ((m_fd = io_uring_setup(entries, &m_params)) < 0 && errno == EINVAL) {
+		m_params = {};
+		m_fd = io_uring_setup(entries, &m_params);
+	}
+	if (m_fd < 0)
+		throw runtime_error(string("uring: io_uring_setup returns err ") + strerror(errno));
+
+	try {
+		m_sq_ring_size = m_params.sq_off.array + m_params.sq_entries * sizeof(unsigned);
+		m_cq_ring_size = m_params.cq_off.cqes + m_params.cq_entries * sizeof(struct io_uring_cqe);
+		m_sqes_size = m_params.sq_entries * sizeof(struct io_uring_sqe);
+		m_sq_ring = map_ring(m_fd, m_sq_ring_size, IORING_OFF_SQ_RING);
+		m_cq_ring = map_ring(m_fd, m_cq_ring_size, IORING_OFF_CQ_RING);
+		m_sqes = static_cast<struct io_uring_sqe *>(map_ring(m_fd, m_sqes_size, IORING_OFF_SQES));
+	} catch (runtime_error &) {
+		release();
+		throw;
+	}
+
+	uint8_t *sq = static_cast<uint8_t *>(m_sq_ring), *cq = static_cast<uint8_t *>(m_cq_ring);
+	m_sq_head = reinterpret_cast<unsigned *>(sq + m_params.sq_off.head);
+	m_sq_tail = reinterpret_cast<unsigned *>(sq + m_params.sq_off.tail);
+	m_sq_mask = *reinterpret_cast<unsigned *>(sq + m_params.sq_off.ring_mask);
+	m_cq_head = reinterpret_cast<unsigned *>(cq + m_params.cq_off.head);
+	m_cq_tail = reinterpret_cast<unsigned *>(cq + m_params.cq_off.tail);
+	m_cq_mask = *reinterpret_cast<unsigned *>(cq + m_params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + m_params.cq_off.cqes);
+
+	// sqes are always used in ring order, so the indirection array is the identity
+	unsigned *array = reinterpret_cast<unsigned *>(sq + m_params.sq_off.array);
+	for (unsigned i = 0; i < m_params.sq_entries; ++i)
+		array[i] = i;
+}
+
+uring::~uring() {
+	release();
+}
+
+void uring::release() {
+	if (m_bufs) munmap(m_bufs, m_bufs_size);
+	if (m_sqes) munmap(m_sqes, m_sqes_size);
+	if (m_cq_ring) munmap(m_cq_ring, m_cq_ring_size);
+	if (m_sq_ring) munmap(m_sq_ring, m_sq_ring_size);
+	if (m_fd >= 0) close(m_fd);
+	m_bufs = nullptr, m_sqes = nullptr, m_cq_ring = m_sq_ring = nullptr, m_fd = -1;
+}
+
+struct io_uring_sqe *uring::get_sqe() {
+	unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+	if (m_sq_local - head >= m_params.sq_entries)
+		return nullptr;
+	struct io_uring_sqe *sqe = &m_sqes[m_sq_local++ & m_sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+void uring::submit(unsigned wait) {
+	__atomic_store_n(m_sq_tail, m_sq_local, __ATOMIC_RELEASE);
+	for (;;) {
+		int n = io_uring_enter(m_fd, m_sq_local - m_submitted, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+		if (n >= 0) {
+			m_submitted += n;
+			return;
+		}
+		// the completion queue is full: the caller has to reap first
+		if (errno == EBUSY || errno == EAGAIN)
+			return;
+		if (errno != EINTR)
+			throw runtime_error(string("uring: io_uring_enter returns err ") + strerror(errno));
+	}
+}
+
+void uring::register_files(const int *fds, unsigned n) {
+	if (io_uring_register(m_fd, IORING_REGISTER_FILES, fds, n) < 0)
+		throw runtime_error(string("uring: register files returns err ") + strerror(errno));
+}
+
+void uring::register_buffer(void *base, size_t len) {
+	struct iovec iov { base, len };
+	if (io_uring_register(m_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+		throw runtime_error(string("uring: register buffers returns err ") + strerror(errno));
+}
+
+void uring::setup_buffer_ring(unsigned entries) {
+	m_bufs_size = entries * sizeof(struct io_uring_buf);
+	void *p = mmap(nullptr, m_bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		throw runtime_error(string("uring: mmap returns err ") + strerror(errno));
+	m_bufs = static_cast<struct io_uring_buf_ring *>(p);
+	m_bufs_mask = entries - 1;
+
+	struct io_uring_buf_reg reg {};
+	reg.ring_addr = reinterpret_cast<uint64_t>(m_bufs);
+	reg.ring_entries = entries;
+	reg.bgid = 0;
+	if (io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		throw runtime_error(string("uring: register buffer ring returns err ") + strerror(errno));
+}
+
+void uring::provide_buffer(void *addr, unsigned len, uint16_t bid) {
+	// not m_bufs->bufs: as c++ sees the uapi header, that flexible array
+	// starts 8 bytes too late
+	struct io_uring_buf &b = reinterpret_cast<struct io_uring_buf *>(m_bufs)[m_bufs_tail & m_bufs_mask];
+	b.addr = reinterpret_cast<uint64_t>(addr);
+	b.len = len;
+	b.bid = bid;
+	__atomic_store_n(&m_bufs->tail, ++m_bufs_tail, __ATOMIC_RELEASE);
+}
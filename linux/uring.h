@@ -0,0 +1,332 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "../packet.h"
+#include "../addr.h"
+#include "sockaddr.h"
+
+// a minimal io_uring, set up and driven with the raw syscalls
+class uring {
+	int m_fd = -1;
+	struct io_uring_params m_params {};
+
+	void *m_sq_ring = nullptr, *m_cq_ring = nullptr;
+	size_t m_sq_ring_size = 0, m_cq_ring_size = 0;
+	struct io_uring_sqe *m_sqes = nullptr;
+	size_t m_sqes_size = 0;
+
+	unsigned *m_sq_head, *m_sq_tail, m_sq_mask;
+	unsigned *m_cq_head, *m_cq_tail, m_cq_mask;
+	struct io_uring_cqe *m_cqes;
+	// sqes handed out, and how many of them the kernel has taken
+	unsigned m_sq_local = 0, m_submitted = 0;
+
+	struct io_uring_buf_ring *m_bufs = nullptr;
+	size_t m_bufs_size = 0;
+	unsigned m_bufs_mask = 0;
+	uint16_t m_bufs_tail = 0;
+
+	void release();
+
+public:
+	explicit uring(unsigned entries);
+	uring(const uring &) = delete;
+	uring &operator=(const uring &) = delete;
+	~uring();
+
+	// a zeroed sqe, or nullptr if the submission queue is full
+	struct io_uring_sqe *get_sqe();
+	// submits what was queued and waits for at least wait completions
+	void submit(unsigned wait);
+
+	template <typename F>
+	void for_each_cqe(F f) {
+		unsigned head = *m_cq_head;
+		unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head)
+			f(m_cqes[head & m_cq_mask]);
+		__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	// fds[i] is then file i of IOSQE_FIXED_FILE
+	void register_files(const int *fds, unsigned n);
+	// the memory of the fixed reads and writes, buffer index 0
+	void register_buffer(void *base, size_t len);
+	// a ring of provided buffers for IOSQE_BUFFER_SELECT, group 0
+	void setup_buffer_ring(unsigned entries);
+	// hands buffer bid back to the kernel
+	void provide_buffer(void *addr, unsigned len, uint16_t bid);
+};
+
+// moves packets between a tun and a udp socket from one io_uring, on the
+// calling thread. the handler decides what happens to them:
+//   bool on_tun(packet_buf &p, Addr &to)          seal p and pick its peer; false drops it
+//   bool on_net(packet_buf &p, const Addr &from)  open p; false drops it
+//   void on_tick()                                about once a second
+//   void on_error(const std::string &what)        an operation failed
+//
+// the packets live in one arena registered as a fixed buffer, both fds are
+// registered files, tun reads and writes are fixed, and the socket is read
+// by a multishot recvmsg that picks from a ring of provided buffers.
+template <typename Addr>
+class uring_tunnel {
+	using saddr_type = typename sockaddr_of<Addr>::type;
+
+	enum : uint64_t { op_read, op_send, op_recv, op_write, op_tick };
+	enum : int { tun_file, sock_file };
+
+	// room for the iv, and for what multishot recvmsg puts in front of the payload
+	static constexpr size_t headroom = 64, capacity = 4096, tailroom = 64;
+	static constexpr size_t slot_size = headroom + capacity + tailroom;
+	static constexpr size_t recv_offset = sizeof(struct io_uring_recvmsg_out) + sizeof(saddr_type);
+	static_assert(recv_offset <= headroom, "the receive header must fit in the headroom");
+
+	// a tun read is sealed and sent from its own slot
+	struct tx_slot {
+		struct msghdr msg;
+		struct iovec iov;
+		saddr_type to;
+	};
+
+	const int m_tun, m_sock;
+	const size_t m_tx_count, m_rx_count;
+	std::unique_ptr<uint8_t[]> m_arena;
+	std::vector<packet_buf> m_tx, m_rx;
+	std::vector<tx_slot> m_slots;
+	struct msghdr m_recv_msg {};
+	struct __kernel_timespec m_tick {};
+	// multishot receive stopped for lack of buffers, restart it once one is back
+	bool m_starved = false;
+	// multishot receive stopped with an error, restart it on the next tick
+	bool m_failed = false;
+	uring m_ring;
+
+	static uint64_t tag(uint64_t op, uint64_t i) {
+		return op << 32 | i;
+	}
+
+	uint8_t *slot(size_t i) {
+		return m_arena.get() + i * slot_size;
+	}
+
+	struct io_uring_sqe *next_sqe() {
+		struct io_uring_sqe *sqe;
+		while (!(sqe = m_ring.get_sqe()))
+			m_ring.submit(0);
+		return sqe;
+	}
+
+	void arm_read(size_t i) {
+		packet_buf &p = m_tx[i];
+		p.reset();
+		struct io_uring_sqe *sqe = next_sqe();
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = tun_file;
+		sqe->addr = reinterpret_cast<uint64_t>(p.data());
+		sqe->len = p.capacity();
+		sqe->buf_index = 0;
+		sqe->user_data = tag(op_read, i);
+	}
+
+	void arm_send(size_t i, const Addr &to) {
+		tx_slot &s = m_slots[i];
+		set_sockaddr(s.to, to);
+		s.iov.iov_base = m_tx[i].data();
+		s.iov.iov_len = m_tx[i].size();
+		struct io_uring_sqe *sqe = next_sqe();
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = sock_file;
+		sqe->addr = reinterpret_cast<uint64_t>(&s.msg);
+		sqe->len = 1;
+		sqe->user_data = tag(op_send, i);
+	}
+
+	void arm_recv() {
+		struct io_uring_sqe *sqe = next_sqe();
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+		sqe->fd = sock_file;
+		sqe->addr = reinterpret_cast<uint64_t>(&m_recv_msg);
+		sqe->len = 1;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->buf_group = 0;
+		sqe->user_data = tag(op_recv, 0);
+	}
+
+	void arm_write(size_t bid) {
+		packet_buf &p = m_rx[bid];
+		struct io_uring_sqe *sqe = next_sqe();
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = tun_file;
+		sqe->addr = reinterpret_cast<uint64_t>(p.data());
+		sqe->len = p.size();
+		sqe->buf_index = 0;
+		sqe->user_data = tag(op_write, bid);
+	}
+
+	void arm_tick() {
+		struct io_uring_sqe *sqe = next_sqe();
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = reinterpret_cast<uint64_t>(&m_tick);
+		sqe->len = 1;
+		sqe->user_data = tag(op_tick, 0);
+	}
+
+	void recycle(size_t bid) {
+		m_ring.provide_buffer(slot(m_tx_count + bid), slot_size, bid);
+		if (m_starved) {
+			m_starved = false;
+			arm_recv();
+		}
+	}
+
+	template <typename Handler>
+	void received(const struct io_uring_cqe &c, Handler &h) {
+		if (!(c.flags & IORING_CQE_F_MORE)) {
+			if (c.res == -ENOBUFS)
+				m_starved = true;
+			else if (c.res < 0)
+				// right away, a lasting error would fail again on every turn
+				m_failed = true;
+			else
+				arm_recv();
+		}
+		if (!(c.flags & IORING_CQE_F_BUFFER)) {
+			if (c.res < 0 && c.res != -ENOBUFS)
+				h.on_error(std::string("recvmsg: ") + strerror(-c.res));
+			return;
+		}
+
+		size_t bid = c.flags >> IORING_CQE_BUFFER_SHIFT;
+		const uint8_t *base = slot(m_tx_count + bid);
+		struct io_uring_recvmsg_out out;
+		saddr_type from;
+		memcpy(&out, base, sizeof(out));
+		memcpy(&from, base + sizeof(out), sizeof(from));
+
+		Addr ad;
+		packet_buf &p = m_rx[bid];
+		p.reset();
+		if (c.res < 0 || (out.flags & MSG_TRUNC) || !get_sockaddr(from, ad)) {
+			recycle(bid);
+			return;
+		}
+		p.resize(out.payloadlen);
+		if (h.on_net(p, ad))
+			arm_write(bid);
+		else
+			recycle(bid);
+	}
+
+	template <typename Handler>
+	void complete(const struct io_uring_cqe &c, Handler &h) {
+		size_t i = c.user_data & 0xffffffff;
+		switch (c.user_data >> 32) {
+		case op_read:
+			if (c.res < 0) {
+				h.on_error(std::string("tun read: ") + strerror(-c.res));
+				arm_read(i);
+			} else {
+				Addr to;
+				m_tx[i].resize(c.res);
+				if (h.on_tun(m_tx[i], to))
+					arm_send(i, to);
+				else
+					arm_read(i);
+			}
+			break;
+		case op_send:
+			if (c.res < 0)
+				h.on_error(std::string("sendmsg: ") + strerror(-c.res));
+			arm_read(i);
+			break;
+		case op_recv:
+			received(c, h);
+			break;
+		case op_write:
+			if (c.res < 0)
+				h.on_error(std::string("tun write: ") + strerror(-c.res));
+			recycle(i);
+			break;
+		case op_tick:
+			if (m_failed) {
+				m_failed = false;
+				arm_recv();
+			}
+			h.on_tick();
+			arm_tick();
+			break;
+		}
+	}
+
+	static unsigned ring_entries(size_t n) {
+		unsigned e = 8;
+		while (e < n) e <<= 1;
+		return e;
+	}
+
+public:
+	// depth is the number of tun reads in flight; twice as many receive buffers are provided
+	uring_tunnel(int tun, int sock, size_t depth) :
+		m_tun(tun), m_sock(sock), m_tx_count(depth), m_rx_count(ring_entries(depth * 2)),
+		m_arena(new uint8_t[(m_tx_count + m_rx_count) * slot_size]), m_slots(depth),
+		m_ring(ring_entries(m_tx_count + m_rx_count + 2)) {
+		for (size_t i = 0; i < m_tx_count; ++i)
+			m_tx.emplace_back(slot(i), headroom, capacity, tailroom);
+		for (size_t i = 0; i < m_rx_count; ++i)
+			m_rx.emplace_back(slot(m_tx_count + i), recv_offset, slot_size - recv_offset, 0);
+
+		for (tx_slot &s : m_slots) {
+			s.msg = {};
+			s.msg.msg_name = &s.to;
+			s.msg.msg_namelen = sizeof(s.to);
+			s.msg.msg_iov = &s.iov;
+			s.msg.msg_iovlen = 1;
+		}
+		// multishot recvmsg only looks at the name and control sizes
+		m_recv_msg.msg_namelen = sizeof(saddr_type);
+		m_tick.tv_sec = 1;
+
+		// io_uring polls by itself, but fails reads of an O_NONBLOCK file with EAGAIN
+		int flags = fcntl(m_tun, F_GETFL);
+		if (flags < 0 || fcntl(m_tun, F_SETFL, flags & ~O_NONBLOCK) < 0)
+			throw std::runtime_error(std::string("uring_tunnel: fcntl returns err ") + strerror(errno));
+
+		int fds[] = { m_tun, m_sock };
+		m_ring.register_files(fds, 2);
+		m_ring.register_buffer(m_arena.get(), (m_tx_count + m_rx_count) * slot_size);
+		m_ring.setup_buffer_ring(m_rx_count);
+	}
+	uring_tunnel(const uring_tunnel &) = delete;
+	uring_tunnel &operator=(const uring_tunnel &) = delete;
+
+	template <typename Handler>
+	void run(Handler &h) {
+		for (size_t i = 0; i < m_tx_count; ++i)
+			arm_read(i);
+		for (size_t i = 0; i < m_rx_count; ++i)
+			m_ring.provide_buffer(slot(m_tx_count + i), slot_size, i);
+		arm_recv();
+		arm_tick();
+
+		for (;;) {
+			m_ring.submit(1);
+			m_ring.for_each_cqe([&](const struct io_uring_cqe &c) { complete(c, h); });
+		}
+	}
+};
@@ -1,11 +1,15 @@
 ﻿#include <iostream>
 #include <stdexcept>
+#include <string>
+#include <cstdlib>
 
 #include "init.h"
 #include "server.h"
 #include "client.h"
 #include "tun.h"
 #include "cipher.h"
+#include "options.h"
+#include "socket.h"
 
 using std::cout;
 using std::cerr;
@@ -15,18 +19,62 @@ void init() {
 	init_platform();
 }
 
+static options parse_options(int argc, char **argv) {
+	options opts;
+	for (int i = 0; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-q" && i + 1 < argc) {
+			opts.queues = std::strtoul(argv[++i], nullptr, 10);
+			if (opts.queues == 0) throw std::runtime_error("queues must be positive");
+		} else if (arg == "-w" && i + 1 < argc) {
+			opts.workers = std::strtoul(argv[++i], nullptr, 10);
+			if (opts.workers == 0) throw std::runtime_error("workers must be positive");
+		} else if (arg == "-s") {
+			opts.steer = true;
+		} else if (arg == "-o") {
+			opts.offload = true;
+		} else if (arg == "-v") {
+			opts.vnet = true;
+		} else if (arg == "-u") {
+			opts.uring = true;
+		} else if (arg == "-e") {
+			opts.loop = true;
+		} else if (arg == "-t") {
+			opts.tcp = true;
+		} else if (arg == "-z") {
+			opts.zerocopy = true;
+		} else if (arg == "-b" && i + 1 < argc) {
+			opts.batch = std::strtoul(argv[++i], nullptr, 10);
+			if (opts.batch == 0 || opts.batch > max_batch)
+				throw std::runtime_error("batch must be between 1 and " + std::to_string(max_batch));
+		} else {
+			throw std::runtime_error("unknow option `" + arg + "'");
+		}
+	}
+	if (opts.uring && (opts.vnet || opts.offload))
+		throw std::runtime_error("-u can't be combined with -v or -o");
+	if (opts.loop && (opts.uring || opts.vnet))
+		throw std::runtime_error("-e can't be combined with -u or -v");
+	if (opts.tcp && (opts.uring || opts.vnet || opts.offload))
+		throw std::runtime_error("-t can't be combined with -u, -v or -o");
+	if (opts.zerocopy && !opts.tcp)
+		throw std::runtime_error("-z needs -t");
+	return opts;
+}
+
 int main(int argc, char **argv) {
 	init();
 	if (argc < 3) {
-		cerr << "usage: " << argv[0] << " client server_addr" << endl;
-		cerr << "       " << argv[0] << " server listen_addr" << endl;
+		cerr << "usage: " << argv[0] << " client server_addr [-b batch] [-o] [-v] [-u] [-e] [-t [-z]]" << endl;
+		cerr << "       " << argv[0] << " server listen_addr [-q queues] [-w workers [-s]] [-b batch] [-o] [-v] [-u] [-t [-z]]" << endl;
 		return 1;
 	}
 	try {
+		options opts = parse_options(argc - 3, argv + 3);
 		if (argv[1][0] == 'c') {
-			start_client(argv[2]);
+			start_client(argv[2], opts);
 		} else if (argv[1][0] == 's') {
-			start_server(argv[2]);
+			start_server(argv[2], opts);
 		}
 	} catch (std::runtime_error e) {
 		cerr << "[error] " << e.what() << endl;
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <cstring>
+
+// a byte ring whose memory is mapped twice, back to back, so the data and
+// the free space are each one contiguous span wherever they wrap: reading
+// past the end of the first mapping reads the start of the ring again.
+// the capacity is rounded up to whole pages.
+class mirror_buffer {
+	uint8_t *m_base = nullptr;
+	size_t m_capacity = 0;
+	// the data is [m_base + m_head, m_base + m_head + m_size), m_head < m_capacity
+	size_t m_head = 0, m_size = 0;
+
+public:
+	explicit mirror_buffer(size_t n);
+	mirror_buffer(const mirror_buffer &) = delete;
+	mirror_buffer &operator=(const mirror_buffer &) = delete;
+	mirror_buffer(mirror_buffer &&b) :
+		m_base(b.m_base), m_capacity(b.m_capacity), m_head(b.m_head), m_size(b.m_size) {
+		b.m_base = nullptr;
+		b.m_capacity = b.m_head = b.m_size = 0;
+	}
+	mirror_buffer &operator=(mirror_buffer &&b);
+	~mirror_buffer();
+
+	size_t size() const {
+		return m_size;
+	}
+	size_t capacity() const {
+		return m_capacity;
+	}
+	bool empty() const {
+		return m_size == 0;
+	}
+
+	// the data, size() bytes
+	uint8_t *data() {
+		return m_base + m_head;
+	}
+	const uint8_t *data() const {
+		return m_base + m_head;
+	}
+
+	// the free space, room() bytes; commit() what was written there
+	uint8_t *space() {
+		return m_base + m_head + m_size;
+	}
+	size_t room() const {
+		return m_capacity - m_size;
+	}
+	void commit(size_t n) {
+		assert(room() >= n);
+		m_size += n;
+	}
+
+	// drops n bytes from the front
+	void consume(size_t n) {
+		assert(m_size >= n);
+		m_size -= n;
+		m_head += n;
+		if (m_head >= m_capacity) m_head -= m_capacity;
+		// an empty ring starts over, which keeps the next data in the pages just used
+		if (m_size == 0) m_head = 0;
+	}
+
+	void append(const uint8_t *buf, size_t len) {
+		assert(room() >= len);
+		memcpy(space(), buf, len);
+		m_size += len;
+	}
+	void poll(uint8_t *buf, size_t len) {
+		assert(m_size >= len);
+		memcpy(buf, data(), len);
+		consume(len);
+	}
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+
+struct options {
+	size_t queues = 1;
+	size_t batch = 32;
+	// udp sockets sharing the listen address, each read by its own worker
+	size_t workers = 1;
+	// spread clients over the workers by source address instead of the kernel's flow hash
+	bool steer = false;
+	// udp segmentation offload (gso/gro) on the tunnel sockets
+	bool offload = false;
+	// tun with vnet headers, handing over tcp super-packets to be segmented here
+	bool vnet = false;
+	// drive the tun and the socket from one io_uring per queue instead of a thread per direction
+	bool uring = false;
+	// serve the client's tun and socket from one non-blocking event loop instead of a thread per direction
+	bool loop = false;
+	// carry the tunnel over tcp connections instead of udp
+	bool tcp = false;
+	// send large tcp writes with MSG_ZEROCOPY
+	bool zerocopy = false;
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <memory>
+
+// a packet buffer that reserves room in front of and behind the payload,
+// so that headers and trailers (iv, tag) can be added in place without
+// copying the payload.
+class packet_buf {
+	std::unique_ptr<uint8_t[]> m_owned;
+	uint8_t *m_base;
+	size_t m_headroom, m_capacity, m_tailroom;
+	uint8_t *m_data;
+	size_t m_len = 0;
+
+public:
+	packet_buf(size_t headroom, size_t capacity, size_t tailroom) :
+		m_owned(new uint8_t[headroom + capacity + tailroom]), m_base(m_owned.get()),
+		m_headroom(headroom), m_capacity(capacity), m_tailroom(tailroom),
+		m_data(m_base + headroom) {
+	}
+	// lays the buffer out over memory owned by someone else, such as a shared arena
+	packet_buf(uint8_t *base, size_t headroom, size_t capacity, size_t tailroom) :
+		m_base(base), m_headroom(headroom), m_capacity(capacity), m_tailroom(tailroom),
+		m_data(m_base + headroom) {
+	}
+	packet_buf(const packet_buf &) = delete;
+	packet_buf &operator=(const packet_buf &) = delete;
+	packet_buf(packet_buf &&) = default;
+	packet_buf &operator=(packet_buf &&) = default;
+
+	uint8_t *data() {
+		return m_data;
+	}
+	const uint8_t *data() const {
+		return m_data;
+	}
+
+	size_t size() const {
+		return m_len;
+	}
+
+	// the payload size the buffer was created for
+	size_t capacity() const {
+		return m_capacity;
+	}
+
+	size_t headroom() const {
+		return m_data - m_base;
+	}
+
+	size_t tailroom() const {
+		return m_headroom + m_capacity + m_tailroom - headroom() - m_len;
+	}
+
+	// empties the buffer and puts the data back behind the reserved headroom
+	void reset() {
+		m_data = m_base + m_headroom;
+		m_len = 0;
+	}
+
+	void resize(size_t len) {
+		assert(len <= m_len + tailroom());
+		m_len = len;
+	}
+
+	// prepends n bytes and returns the new front
+	uint8_t *push(size_t n) {
+		assert(headroom() >= n);
+		m_data -= n;
+		m_len += n;
+		return m_data;
+	}
+
+	// strips n bytes from the front and returns the new front
+	uint8_t *pull(size_t n) {
+		assert(m_len >= n);
+		m_data += n;
+		m_len -= n;
+		return m_data;
+	}
+
+	// appends n bytes and returns where they start
+	uint8_t *put(size_t n) {
+		assert(tailroom() >= n);
+		uint8_t *tail = m_data + m_len;
+		m_len += n;
+		return tail;
+	}
+};
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <vector>
+#include <chrono>
+#include <climits>
+#include <algorithm>
+#include <stdexcept>
 
 #if defined(__linux__)
 	#include "linux/epoll.h"
@@ -8,10 +12,25 @@
 
 #include "utils.h"
 #include "socket.h"
+#include "timer_wheel.h"
 
+// readiness of fds, plus timers that run on the thread that waits. the
+// timers need no fd of their own: wait() sleeps no longer than the next one
+// is due, and runs the due ones once it has dispatched the ready fds.
 template <typename Impl, typename Conn, bool (*on_writable)(Conn&)>
 class poller : private Impl {
+	timer_wheel m_timers{ now() };
+
+	static uint64_t now() {
+		using namespace std::chrono;
+		return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
 public:
+	using timer_id = timer_wheel::timer_id;
+
+	explicit poller(bool edge_triggered = false) : Impl(edge_triggered) {}
+
 	template <typename ...Args>
 	void add(socket_t sock, Args && ...args) {
 		Impl::add(sock, std::forward<Args>(args)...);
@@ -22,21 +41,53 @@ public:
 		Impl::del(sock);
 	}
 
+	Conn *get(socket_t sock) {
+		return Impl::get(sock);
+	}
+
 	void wait_write(socket_t sock) {
 		Impl::set(sock, Impl::EV_WRITE);
 	}
 
-	void wait(int timeout, const std::function<void(socket_t, Conn&)> &f) {
+	// calls f in delay milliseconds, then every period milliseconds if period isn't 0
+	timer_id add_timer(uint64_t delay, uint64_t period, timer_wheel::callback f) {
+		return m_timers.add(now() + delay, period, std::move(f));
+	}
+
+	void cancel_timer(timer_id id) {
+		m_timers.cancel(id);
+	}
+
+	// calls f(socket_t, Conn &) for every readable fd; f is inlined into the dispatch.
+	// a timeout of -1 waits until an fd is ready or a timer is due
+	template <typename F>
+	void wait(int timeout, F &&f) {
+		uint64_t next = m_timers.next_expiry();
+		if (next != timer_wheel::never) {
+			uint64_t t = now();
+			int until = next > t ? static_cast<int>(std::min<uint64_t>(next - t, INT_MAX)) : 0;
+			timeout = timeout < 0 ? until : std::min(timeout, until);
+		}
+
 		Impl::wait(timeout, [this, &f](socket_t sock, uint32_t events, Conn &conn) {
+			bool failed = false;
 			if (events & Impl::EV_WRITE) {
-				if (!on_writable(conn)) {
+				try {
+					if (!on_writable(conn)) {
+						Impl::unset(sock, Impl::EV_WRITE);
+					}
+				} catch (std::runtime_error &) {
 					Impl::unset(sock, Impl::EV_WRITE);
+					failed = true;
 				}
 			}
-			if (events & Impl::EV_READ) {
+			// errors, and writes that failed, are handed to the reader, whose
+			// next receive fails with them
+			if (failed || (events & (Impl::EV_READ | Impl::EV_ERROR))) {
 				f(sock, conn);
 			}
 		});
+		m_timers.advance(now());
 	}
 };
 
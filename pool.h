@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <memory>
+#include <utility>
+#include <stdexcept>
+
+// a fixed-capacity slab of T. objects are cache-line aligned and recycled
+// through a free list, so allocating never touches the global allocator
+// once the pool is built. the free list is kept apart from the objects and
+// the memory stays mapped until the pool itself is destroyed, which lets
+// lock-free readers safely look at an object that was freed under them,
+// as long as they validate what they read.
+template <typename T, size_t Align = 64>
+class object_pool {
+	struct alignas(Align) cell {
+		unsigned char storage[sizeof(T)];
+	};
+
+	std::unique_ptr<cell[]> m_cells;
+	std::unique_ptr<cell *[]> m_free;
+	size_t m_capacity, m_size = 0;
+
+public:
+	explicit object_pool(size_t capacity) :
+		m_cells(new cell[capacity]), m_free(new cell *[capacity]), m_capacity(capacity) {
+		for (size_t i = 0; i < capacity; ++i)
+			m_free[i] = &m_cells[capacity - 1 - i];
+	}
+	object_pool(const object_pool &) = delete;
+	object_pool &operator=(const object_pool &) = delete;
+
+	template <typename ...Args>
+	T *alloc(Args && ...args) {
+		if (m_size == m_capacity)
+			throw std::runtime_error("object pool is exhausted");
+		T *p = new (m_free[m_capacity - m_size - 1]->storage) T(std::forward<Args>(args)...);
+		++m_size;
+		return p;
+	}
+
+	void free(T *p) {
+		p->~T();
+		--m_size;
+		m_free[m_capacity - m_size - 1] = reinterpret_cast<cell *>(p);
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+
+	size_t capacity() const {
+		return m_capacity;
+	}
+};
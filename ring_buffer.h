@@ -1,6 +1,8 @@
 #pragma once
 
 #include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <cassert>
 #include <functional>
 
@@ -177,7 +179,7 @@ ptrdiff_t ring_buffer_iterator<T>::index() const {
 	if (m_curr >= m_buff->m_front) {
 		return m_curr - m_buff->m_front;
 	} else {
-		return (m_buff->m_last - m_buff->m_front) - (m_curr - m_buff->m_base);
+		return (m_buff->m_last - m_buff->m_front) + (m_curr - m_buff->m_base);
 	}
 }
 
@@ -1,115 +1,475 @@
 #include "server.h"
 
 #include <thread>
+#include <vector>
 #include <string>
 #include <memory>
 #include <chrono>
 #include <stdexcept>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <algorithm>
 
 #include "tun.h"
+#include "vnet.h"
 #include "udp.h"
 #include "tcp.h"
 #include "poller.h"
 #include "utils.h"
 #include "session_mgr.h"
 #include "cipher.h"
+#if defined(__linux__)
+	#include "linux/uring.h"
+#endif
 
 using std::thread;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 using std::runtime_error;
 using std::cerr;
 using std::endl;
 
 typedef sudp4<chacha20_poly1305_indep> udp_type;
 
-static void server_tun2net(const tun_t *tun, udp_type *u, session_mgr<IPv4, addr_ipv4> *smgr) {
+// decrypted packets keep room in front for a vnet header
+static vector<packet_buf> make_packets(size_t n) {
 	const size_t buff_size = 4096;
-	unique_ptr<uint8_t[]> buff(new uint8_t[buff_size]);
+	vector<packet_buf> pkts;
+	pkts.reserve(n);
+	for (size_t i = 0; i < n; ++i)
+		pkts.emplace_back(sizeof(vnet_hdr) + udp_type::headroom, buff_size, udp_type::tailroom);
+	return pkts;
+}
+
+static size_t read_packets(const tun_t &tun, vnet_reader *reader, packet_buf *pkts, size_t n) {
+	return reader ? reader->read_batch(pkts, n) : tun_read_batch(tun, pkts, n);
+}
+
+static void write_packets(const tun_t &tun, vnet_writer *writer, packet_buf *pkts, size_t n) {
+	if (writer) {
+		writer->write_batch(pkts, n);
+		return;
+	}
+	for (size_t i = 0; i < n; ++i)
+		tun_write(tun, pkts[i].data(), pkts[i].size());
+}
+
+static void server_tun2net(const tun_t *tun, udp_type *u, session_mgr<IPv4, addr_ipv4> *smgr, const options *opts) {
+	const size_t batch = opts->batch;
+	vector<packet_buf> pkts = make_packets(batch);
+	vector<addr_ipv4> clients(batch);
+	unique_ptr<vnet_reader> reader(opts->vnet ? new vnet_reader(*tun) : nullptr);
 	for (;;) {
 		try {
-			size_t size = tun_read(*tun, buff.get(), buff_size);
-			IPv4 dst = parse_dst_ip<IPv4>(buff.get());
-			addr_ipv4 client = smgr->get(dst);
-			u->sendto(buff.get(), size, client);
+			size_t n = read_packets(*tun, reader.get(), pkts.data(), batch), m = 0;
+			for (size_t i = 0; i < n; ++i) {
+				try {
+					IPv4 dst = parse_dst_ip<IPv4>(pkts[i].data());
+					clients[m] = smgr->get(dst);
+					if (m != i) std::swap(pkts[m], pkts[i]);
+					++m;
+				} catch (runtime_error e) {
+					cerr << "[error] server_tun2net " << e.what() << endl;
+				}
+			}
+			u->send_batch(pkts.data(), clients.data(), m);
 		} catch (runtime_error e) {
 			cerr << "[error] server_tun2net " << e.what() << endl;
 		}
 	}
 }
 
-static void server_net2tun(const tun_t *tun, udp_type *u, session_mgr<IPv4, addr_ipv4> *smgr) {
-	const size_t buff_size = 4096;
-	unique_ptr<uint8_t[]> buff(new uint8_t[buff_size]);
-	addr_ipv4 client;
+static void server_net2tun(const tun_t *tun, udp_type *u, session_mgr<IPv4, addr_ipv4> *smgr, const options *opts) {
+	const size_t batch = opts->batch;
+	vector<packet_buf> pkts = make_packets(batch);
+	vector<addr_ipv4> clients(batch);
+	unique_ptr<vnet_writer> writer(opts->vnet ? new vnet_writer(*tun) : nullptr);
 	for (;;) {
 		try {
-			size_t size = u->recvfrom(buff.get(), buff_size, client);
-			IPv4 src = parse_src_ip<IPv4>(buff.get());
-			smgr->put(src, client);
-			tun_write(*tun, buff.get(), size);
+			size_t n = u->recv_batch(pkts.data(), clients.data(), batch), m = 0;
+			smgr->update();
+			for (size_t i = 0; i < n; ++i) {
+				try {
+					IPv4 src = parse_src_ip<IPv4>(pkts[i].data());
+					smgr->put(src, clients[i]);
+					if (m != i) std::swap(pkts[m], pkts[i]);
+					++m;
+				} catch (runtime_error e) {
+					cerr << "[error] server_net2tun " << e.what() << endl;
+				}
+			}
+			write_packets(*tun, writer.get(), pkts.data(), m);
 		} catch (runtime_error e) {
 			cerr << "[error] server_net2tun " << e.what() << endl;
 		}
 	}
 }
 
-template <typename Mgr>
-static void update_session_mgr(Mgr &mgr) {
-	using namespace std::chrono;
-	for (;;) {
-		mgr.update();
-		std::this_thread::sleep_for(1s);
+#if defined(__linux__)
+// does the work of a tun2net and net2tun pair from one io_uring
+static void server_uring(const tun_t *tun, udp_type *u, session_mgr<IPv4, addr_ipv4> *smgr, const options *opts) {
+	struct handler {
+		udp_type *u;
+		session_mgr<IPv4, addr_ipv4> *smgr;
+
+		bool on_tun(packet_buf &p, addr_ipv4 &to) {
+			try {
+				to = smgr->get(parse_dst_ip<IPv4>(p.data()));
+			} catch (runtime_error e) {
+				on_error(e.what());
+				return false;
+			}
+			u->seal(p);
+			return true;
+		}
+		bool on_net(packet_buf &p, const addr_ipv4 &from) {
+			try {
+				u->open(p);
+			} catch (runtime_error &) {
+				return false;
+			}
+			try {
+				smgr->put(parse_src_ip<IPv4>(p.data()), from);
+			} catch (runtime_error e) {
+				on_error(e.what());
+				return false;
+			}
+			return true;
+		}
+		void on_tick() {
+			smgr->update();
+		}
+		void on_error(const string &what) {
+			cerr << "[error] server_uring " << what << endl;
+		}
+	} h{ u, smgr };
+
+	try {
+		uring_tunnel<addr_ipv4> loop(*tun, u->get_socket(), opts->batch);
+		loop.run(h);
+	} catch (runtime_error e) {
+		h.on_error(e.what());
 	}
 }
+#endif
 
-static void start_udp(const string &listen_addr) {
+static void start_udp(const string &listen_addr, const options &opts) {
 	string name = "subtun";
-	tun_t tun = tun_alloc(name);
+	vector<tun_t> tuns = opts.vnet ? tun_alloc_vnet(name, opts.queues) : tun_alloc(name, opts.queues);
 	if (guess_addr_type(listen_addr) == addr_type::ipv4) {
 		session_mgr<IPv4, addr_ipv4> smgr(600);
 		addr_ipv4 ad(listen_addr);
-		udp_type udp(ad);
-		thread t2n(server_tun2net, &tun, &udp, &smgr),
-			   n2t(server_net2tun, &tun, &udp, &smgr);
 
-		update_session_mgr(smgr);
-		t2n.join(), n2t.join();
+		// with several workers every one of them gets its own socket, and the
+		// kernel spreads the incoming datagrams over them. an io_uring loop
+		// serves one tun queue and one socket. a socket's cipher is only used
+		// by one sending thread, so there are at least as many as tun queues.
+		const size_t nsocks = opts.uring ? tuns.size() : std::max(tuns.size(), opts.workers);
+		vector<unique_ptr<udp_type>> socks;
+		for (size_t i = 0; i < nsocks; ++i) {
+			socks.emplace_back(new udp_type(ad, nsocks > 1));
+			// wakes idle net2tun workers up so they can expire sessions
+			socks.back()->set_receive_timeout(1000);
+			if (opts.offload && !socks.back()->enable_offload())
+				cerr << "[warning] udp segmentation offload is not available" << endl;
+		}
+		if (opts.steer && socks.size() > 1)
+			socks.front()->steer_by_source(socks.size());
+
+		vector<thread> workers;
+		if (opts.uring) {
+#if defined(__linux__)
+			for (size_t i = 0; i < tuns.size(); ++i)
+				workers.emplace_back(server_uring, &tuns[i], socks[i].get(), &smgr, &opts);
+#else
+			throw runtime_error("io_uring is only available on linux");
+#endif
+		} else {
+			// a tun2net worker per tun queue, a net2tun worker per socket
+			for (size_t i = 0; i < tuns.size(); ++i)
+				workers.emplace_back(server_tun2net, &tuns[i], socks[i % socks.size()].get(), &smgr, &opts);
+			for (size_t i = 0; i < socks.size(); ++i)
+				workers.emplace_back(server_net2tun, &tuns[i % tuns.size()], socks[i].get(), &smgr, &opts);
+		}
+
+		for (thread &t : workers) t.join();
 	} else {
 		throw runtime_error("unknow ip address format `" + listen_addr + "'");
 	}
 }
 
+#if defined(__linux__)
 typedef stcp4_conn<chacha20_poly1305_iter> tcp_type;
 
-static bool on_writable(tcp_type &conn) {
-	return conn.on_writable();
+// a connection of one reactor. the id tells it from later connections that
+// get the same fd once it is closed.
+struct tcp_peer {
+	size_t reactor;
+	socket_t fd;
+	uint64_t id;
+
+	bool operator==(const tcp_peer &o) const {
+		return reactor == o.reactor && fd == o.fd && id == o.id;
+	}
+};
+
+// what a reactor polls; its tun queue, listener and waker have no connection
+struct tcp_slot {
+	explicit tcp_slot(uint64_t id_) : id(id_) {}
+	tcp_slot(uint64_t id_, tcp_type &&conn_) : id(id_), conn(std::move(conn_)) {}
+
+	uint64_t id;
+	std::optional<tcp_type> conn;
+	// has packets queued for the flush at the end of this round
+	bool dirty = false;
+};
+
+static bool on_writable(tcp_slot &s) {
+	return s.conn && s.conn->on_writable();
 }
 
-static void start_tcp(const string &listen_addr) {
-	string name = "subtun";
-	tun_t tun = tun_alloc(name);
-	if (guess_addr_type(listen_addr) == addr_type::ipv4) {
-		session_mgr<IPv4, tcp_type> smgr(600);
-		addr_ipv4 ad(listen_addr);
+// one event loop on one thread, with its own tun queue and its own listener
+// of the SO_REUSEPORT group, so the kernel spreads new connections over the
+// reactors. the poller is edge-triggered: every handler below reads until
+// EAGAIN, and write interest is only armed while a connection has data
+// queued. the tun queue a packet comes out of has nothing to do with the
+// reactor its connection belongs to: packets for the others are queued to
+// their inbox and they are woken up to send them.
+class tcp_reactor {
+	struct parcel {
+		tcp_peer to;
+		size_t len;
+	};
+
+	const size_t m_index;
+	const tun_t &m_tun;
+	session_mgr<IPv4, tcp_peer> &m_smgr;
+	const vector<unique_ptr<tcp_reactor>> &m_reactors;
+	const size_t m_batch;
+	const bool m_zerocopy;
+	tcp4_listener m_listener;
+	waker m_waker;
+	event_poller<tcp_slot, on_writable> m_loop;
+	uint64_t m_next_id = 1;
+	// milliseconds before accepting again after accept failed
+	static constexpr uint64_t accept_backoff = 100;
+	bool m_accept_retry = false;
+
+	// filled by the other reactors: the parcels, and their packets end to end
+	std::mutex m_inbox_lock;
+	vector<parcel> m_inbox;
+	vector<uint8_t> m_inbox_data;
+	// swapped with the inbox, so both keep their capacity
+	vector<parcel> m_parcels;
+	vector<uint8_t> m_parcel_data;
+
+	vector<packet_buf> m_pkts;
+	// the connections with packets queued
+	vector<socket_t> m_dirty;
+
+	// queues a packet on its connection; flush() sends it with the others of this round
+	void send_to(const tcp_peer &to, const uint8_t *data, size_t len) {
+		tcp_slot *s = m_loop.get(to.fd);
+		if (!s || s->id != to.id || !s->conn) return;
+		try {
+			s->conn->queue(data, len);
+		} catch (runtime_error &) {
+			// a full buffer drops the packets, a broken connection fails its next read
+		}
+		if (!s->dirty) {
+			s->dirty = true;
+			m_dirty.push_back(to.fd);
+		}
+	}
 
-		event_poller<tcp_type, on_writable> loop;
+	void flush() {
+		for (socket_t fd : m_dirty) {
+			// the connection may have been deleted since, if a round failed before its flush
+			tcp_slot *s = m_loop.get(fd);
+			if (!s || !s->conn) continue;
+			s->dirty = false;
+			try {
+				s->conn->flush();
+			} catch (runtime_error &) {
+			}
+			if (s->conn->need_to_wait_write())
+				m_loop.wait_write(fd);
+		}
+		m_dirty.clear();
+	}
 
-		tcp4_listener listener(ad);
-		listener.listen();
+	void on_tun() {
+		size_t n;
+		do {
+			n = tun_try_read_batch(m_tun, m_pkts.data(), m_batch);
+			for (size_t i = 0; i < n; ++i) {
+				packet_buf &p = m_pkts[i];
+				try {
+					tcp_peer to = m_smgr.get(parse_dst_ip<IPv4>(p.data()));
+					if (to.reactor == m_index)
+						send_to(to, p.data(), p.size());
+					else
+						m_reactors[to.reactor]->post(to, p.data(), p.size());
+				} catch (runtime_error e) {
+					cerr << "[error] tcp_reactor " << e.what() << endl;
+				}
+			}
+		} while (n == m_batch);
+		flush();
+	}
+
+	void on_inbox() {
+		m_waker.clear();
+		{
+			std::lock_guard<std::mutex> guard(m_inbox_lock);
+			m_parcels.swap(m_inbox);
+			m_parcel_data.swap(m_inbox_data);
+		}
+		const uint8_t *p = m_parcel_data.data();
+		for (const parcel &c : m_parcels) {
+			send_to(c.to, p, c.len);
+			p += c.len;
+		}
+		m_parcels.clear();
+		m_parcel_data.clear();
+		flush();
+	}
 
+	void on_accept() {
+		uint8_t key[] = "12345612345678901234561234567890";
+		try {
+			for (;;) {
+				tcp4_conn plain = m_listener.accept();
+				socket_t fd = plain.get_socket();
+				if (fd == socket_invalid) break;
+				set_nonblocking(fd);
+				tcp_type conn(std::move(plain), key);
+				if (m_zerocopy && !conn.set_zerocopy())
+					cerr << "[error] tcp_reactor zero-copy sends are not supported" << endl;
+				m_loop.add(fd, m_next_id++, std::move(conn));
+			}
+		} catch (runtime_error e) {
+			// out of fds or memory, say. what is pending stays so and no new
+			// edge comes for it, so try again in a while
+			cerr << "[error] tcp_reactor " << e.what() << endl;
+			if (!m_accept_retry) {
+				m_accept_retry = true;
+				m_loop.add_timer(accept_backoff, 0, [this] {
+					m_accept_retry = false;
+					on_accept();
+				});
+			}
+		}
+	}
+
+	void on_conn(socket_t fd, tcp_slot &s) {
+		const tcp_peer me{ m_index, fd, s.id };
+		try {
+			// zero-copy completions come in as errors
+			s.conn->reap_zerocopy();
+			// the session of a source is only refreshed once for a run of its packets
+			IPv4 last;
+			bool has_last = false;
+			while (s.conn->receive([&](uint8_t *body, size_t n) {
+				for_each_ip_packet(body, n, [&](uint8_t *pkt, size_t size) {
+					try {
+						IPv4 src = parse_src_ip<IPv4>(pkt);
+						if (!has_last || !(src == last)) {
+							m_smgr.put(src, me);
+							last = src, has_last = true;
+						}
+						tun_write(m_tun, pkt, size);
+					} catch (runtime_error e) {
+						cerr << "[error] tcp_reactor " << e.what() << endl;
+					}
+				});
+			}));
+		} catch (runtime_error e) {
+			cerr << "[error] tcp_reactor " << e.what() << endl;
+			m_loop.del(fd);
+		}
+	}
+
+public:
+	tcp_reactor(size_t index, const tun_t &tun, const addr_ipv4 &ad, session_mgr<IPv4, tcp_peer> &smgr,
+			const vector<unique_ptr<tcp_reactor>> &reactors, const options &opts) :
+		m_index(index), m_tun(tun), m_smgr(smgr), m_reactors(reactors), m_batch(opts.batch), m_zerocopy(opts.zerocopy),
+		m_listener(ad, true), m_loop(true), m_pkts(make_packets(opts.batch)) {
+		m_listener.listen();
+		set_nonblocking(m_listener.get_socket());
+		m_loop.add(m_tun, 0);
+		m_loop.add(m_listener.get_socket(), 0);
+		m_loop.add(m_waker.get_fd(), 0);
+		// expires the sessions from the reactor's own thread; one of them does the work each second
+		m_loop.add_timer(1000, 1000, [this] { m_smgr.update(); });
+	}
+	tcp_reactor(const tcp_reactor &) = delete;
+	tcp_reactor &operator=(const tcp_reactor &) = delete;
+
+	// queues a packet for one of this reactor's connections, from another reactor
+	void post(const tcp_peer &to, const uint8_t *data, size_t len) {
+		bool idle;
+		{
+			std::lock_guard<std::mutex> guard(m_inbox_lock);
+			idle = m_inbox.empty();
+			m_inbox.push_back({ to, len });
+			m_inbox_data.insert(m_inbox_data.end(), data, data + len);
+		}
+		if (idle) m_waker.wake();
+	}
+
+	void run() {
 		for (;;) {
-			auto plain_conn = listener.accept();
-			uint8_t key[] = "12345612345678901234561234567890";
-			tcp_type conn(std::move(plain_conn), key);
-			loop.add(conn.get_socket(), std::move(conn));
+			try {
+				m_loop.wait(-1, [this](socket_t sock, tcp_slot &s) {
+					if (s.conn)
+						on_conn(sock, s);
+					else if (sock == m_tun)
+						on_tun();
+					else if (sock == m_listener.get_socket())
+						on_accept();
+					else
+						on_inbox();
+				});
+			} catch (runtime_error e) {
+				cerr << "[error] tcp_reactor " << e.what() << endl;
+			}
 		}
+	}
+};
+
+static void start_tcp(const string &listen_addr, const options &opts) {
+	string name = "subtun";
+	// a tun queue and a listener per reactor
+	vector<tun_t> tuns = tun_alloc(name, opts.workers);
+	if (guess_addr_type(listen_addr) == addr_type::ipv4) {
+		session_mgr<IPv4, tcp_peer> smgr(600);
+		addr_ipv4 ad(listen_addr);
+
+		vector<unique_ptr<tcp_reactor>> reactors;
+		for (size_t i = 0; i < tuns.size(); ++i)
+			reactors.emplace_back(new tcp_reactor(i, tuns[i], ad, smgr, reactors, opts));
+
+		vector<thread> workers;
+		for (auto &r : reactors)
+			workers.emplace_back(&tcp_reactor::run, r.get());
+		for (thread &t : workers) t.join();
 	} else {
 		throw runtime_error("unknow ip address format `" + listen_addr + "'");
 	}
 }
+#endif
 
-void start_server(const std::string &listen_addr) {
-    start_udp(listen_addr);
+void start_server(const std::string &listen_addr, const options &opts) {
+	if (opts.tcp) {
+#if defined(__linux__)
+		start_tcp(listen_addr, opts);
+#else
+		throw runtime_error("the tcp transport is only available on linux");
+#endif
+	} else {
+		start_udp(listen_addr, opts);
+	}
 }
@@ -2,4 +2,6 @@
 
 #include <string>
 
-void start_server(const std::string &listen_addr);
+#include "options.h"
+
+void start_server(const std::string &listen_addr, const options &opts);
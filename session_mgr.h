@@ -1,35 +1,100 @@
 #pragma once
 
-#include <map>
 #include <vector>
-#include <list>
-#include <iterator>
 #include <chrono>
 #include <mutex>
+#include <atomic>
 #include <stdexcept>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+#include <thread>
 
-template <typename VIP, typename Conn, size_t Wheel = 101, typename Camp = typename VIP::less>
+#include "pool.h"
+
+// maps virtual ips to connections and expires them after `expire' seconds
+// without traffic.
+//
+// entries come from a fixed-size pool sized by `capacity', so the memory
+// used stays flat however many clients come and go.
+//
+// lookups are lock-free: the table is open-addressed and guarded by a
+// seqlock, so readers copy what they need and retry if a writer got in the
+// way. writers serialize on a mutex, and put() only takes it when the
+// mapping actually changes.
+template <typename VIP, typename Conn, size_t Wheel = 101, typename Hash = typename VIP::hash>
 class session_mgr {
+	static_assert(std::is_trivially_copyable<VIP>::value, "VIP is copied by lock-free readers");
+	static_assert(std::is_trivially_copyable<Conn>::value, "Conn is copied by lock-free readers");
+
 	using time_type = std::chrono::steady_clock::rep;
 
+	// a value readers copy while a writer may be changing it. it is kept in
+	// relaxed atomic words, so the copy is no data race, just possibly torn,
+	// and the seqlock throws a torn one away.
+	template <typename T>
+	class racy {
+		static constexpr size_t words = (sizeof(T) + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+		std::atomic<uintptr_t> m_words[words] = {};
+
+	public:
+		racy() = default;
+		explicit racy(const T &v) {
+			store(v);
+		}
+
+		T load() const {
+			uintptr_t w[words];
+			for (size_t i = 0; i < words; ++i)
+				w[i] = m_words[i].load(std::memory_order_relaxed);
+			T v;
+			std::memcpy(&v, w, sizeof(v));
+			return v;
+		}
+
+		void store(const T &v) {
+			uintptr_t w[words] = {};
+			std::memcpy(w, &v, sizeof(v));
+			for (size_t i = 0; i < words; ++i)
+				m_words[i].store(w[i], std::memory_order_relaxed);
+		}
+	};
+
 	struct node {
 		node() : prev(this), next(this) {}
 		node *prev, *next;
 	};
 	struct entry : node {
-		template <typename VIP_, typename Conn_>
-		entry(VIP_ &&vip_, Conn_ &&conn_, time_type t_)
-			: vip(std::forward<VIP_>(vip_)), conn(std::forward<Conn_>(conn_)), t(t_) {
-		}
+		entry(const VIP &vip_, const Conn &conn_, uint64_t stamp_) : vip(vip_), conn(conn_), stamp(stamp_) {}
 		VIP vip;
-		Conn conn;
-		time_type t;
+		racy<Conn> conn;
+		// the entry's generation in the high half, its expiry second in the low
+		// one. refreshed by readers without the lock, by compare-and-swap, so a
+		// reader holding a freed entry can't refresh whatever took its cell. the
+		// wheel catches up in update().
+		std::atomic<uint64_t> stamp;
 	};
 
-	std::map<VIP, node*, Camp> m_dict;
+	// an empty slot has e == nullptr, a deleted one points to m_dead
+	struct slot {
+		racy<VIP> vip;
+		std::atomic<node *> e{ nullptr };
+	};
+
+	object_pool<entry> m_pool;
+	std::vector<slot> m_slots;
+	const size_t m_mask;
+	size_t m_size = 0, m_used = 0;
+	node m_dead;
+	std::atomic<uint32_t> m_seq{ 0 };
+	// the generation of the next entry
+	uint32_t m_gen = 0;
+
 	node m_time_wheel[Wheel];
-	time_type m_last = -1;
+	time_type m_last;
 	const time_type m_expire;
+	// the current second, advanced by update(); refreshing reads it instead of the clock
+	std::atomic<time_type> m_now;
 	std::mutex m_lock;
 
 	void insert_node(node *target, node *to_be_inserted) {
@@ -55,8 +120,121 @@ class session_mgr {
 		return t;
 	}
 
+	static uint64_t make_stamp(uint32_t gen, time_type expire) {
+		return static_cast<uint64_t>(gen) << 32 | static_cast<uint32_t>(expire);
+	}
+
+	// the expiry of a stamp, which is never more than 2^31 seconds from near
+	static time_type stamp_expire(uint64_t stamp, time_type near) {
+		return near + static_cast<int32_t>(static_cast<uint32_t>(stamp) - static_cast<uint32_t>(near));
+	}
+
+	static size_t table_size(size_t capacity) {
+		size_t n = 8;
+		while (n < capacity * 2) n <<= 1;
+		return n;
+	}
+
+	void write_begin() {
+		m_seq.store(m_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	void write_end() {
+		m_seq.store(m_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// the slot holding vip, or the first free slot of its probe sequence
+	slot *probe(const VIP &vip) {
+		slot *free_slot = nullptr;
+		size_t i = Hash()(vip) & m_mask;
+		for (size_t n = 0; n <= m_mask; ++n, i = (i + 1) & m_mask) {
+			slot &s = m_slots[i];
+			node *e = s.e.load(std::memory_order_relaxed);
+			if (!e) return free_slot ? free_slot : &s;
+			if (e == &m_dead) {
+				if (!free_slot) free_slot = &s;
+			} else if (s.vip.load() == vip) {
+				return &s;
+			}
+		}
+		return free_slot;
+	}
+
+	// a consistent snapshot of vip's entry, its stamp and connection, without locking
+	entry *lookup(const VIP &vip, Conn &conn, uint64_t &stamp) {
+		for (;;) {
+			uint32_t seq = m_seq.load(std::memory_order_acquire);
+			if (seq & 1) {
+				// a writer is in; it holds the table for a few stores at most
+				std::this_thread::yield();
+				continue;
+			}
+
+			slot *s = probe(vip);
+			node *n = s ? s->e.load(std::memory_order_relaxed) : nullptr;
+			entry *e = n && n != &m_dead ? static_cast<entry *>(n) : nullptr;
+			if (e) {
+				conn = e->conn.load();
+				stamp = e->stamp.load(std::memory_order_relaxed);
+			}
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (m_seq.load(std::memory_order_relaxed) == seq)
+				return e;
+		}
+	}
+
+	// refreshes the entry lookup() found with stamp, unless it has been freed
+	// since. nothing is written in the common case, where the expiry second
+	// is unchanged.
+	void touch(entry *e, uint64_t stamp) {
+		const uint32_t gen = stamp >> 32;
+		const uint64_t want = make_stamp(gen, m_now.load(std::memory_order_relaxed) + m_expire);
+		while (stamp != want) {
+			if (e->stamp.compare_exchange_weak(stamp, want, std::memory_order_relaxed))
+				return;
+			// the cell went to another entry
+			if (static_cast<uint32_t>(stamp >> 32) != gen)
+				return;
+		}
+	}
+
+	// drops deleted slots once they make up too much of the table
+	void compact() {
+		std::vector<entry *> live;
+		live.reserve(m_size);
+		for (slot &s : m_slots) {
+			node *e = s.e.load(std::memory_order_relaxed);
+			if (e && e != &m_dead) live.push_back(static_cast<entry *>(e));
+			s.e.store(nullptr, std::memory_order_relaxed);
+		}
+		for (entry *e : live) {
+			slot *s = probe(e->vip);
+			s->vip.store(e->vip);
+			s->e.store(e, std::memory_order_relaxed);
+		}
+		m_used = m_size;
+	}
+
+	// must hold the lock and be inside write_begin/write_end
+	void erase(slot *s) {
+		entry *e = static_cast<entry *>(s->e.load(std::memory_order_relaxed));
+		s->e.store(&m_dead, std::memory_order_relaxed);
+		--m_size;
+		remove_node(e);
+		// a concurrent lookup may still be reading e. the pool keeps its memory
+		// mapped, and the bumped sequence makes that reader retry. one already
+		// past the check only refreshes e if its stamp still has e's generation.
+		m_pool.free(e);
+	}
+
 public:
-	session_mgr(time_type expire) : m_time_wheel{}, m_expire(expire) {}
+	session_mgr(time_type expire, size_t capacity = 65536) :
+		m_pool(capacity), m_slots(table_size(capacity)), m_mask(m_slots.size() - 1),
+		m_time_wheel{}, m_expire(expire), m_now(get_cur_time()) {
+		m_last = m_now.load(std::memory_order_relaxed);
+	}
 	session_mgr(const session_mgr &) = delete;
 	session_mgr &operator=(const session_mgr &) = delete;
 	~session_mgr() {
@@ -65,78 +243,110 @@ public:
 			while (p != &e) {
 				t = p;
 				p = p->next;
-				delete t;
+				m_pool.free(static_cast<entry *>(t));
 			}
 		}
 	}
 
-	template <typename VIP_, typename Conn_>
-	void put(VIP_ &&vip, Conn_ &&conn) {
+	void put(const VIP &vip, const Conn &conn) {
+		// the common case: the mapping is already there, just refresh it
+		Conn cur;
+		uint64_t stamp;
+		if (entry *e = lookup(vip, cur, stamp); e && cur == conn) {
+			touch(e, stamp);
+			return;
+		}
+
+		time_type expire = m_now.load(std::memory_order_relaxed) + m_expire;
 		std::lock_guard<std::mutex> guard(m_lock);
-		time_type expire = get_cur_time() + m_expire;
-		size_t slot = calc_slot(expire);
-
-		auto it = m_dict.find(vip);
-		if (it == m_dict.end()) {
-			entry *e = new entry{ vip, std::forward<Conn_>(conn), expire };
-			insert_node(m_time_wheel + slot, e);
-			m_dict.emplace(std::forward<VIP_>(vip), e);
-		} else {
-			entry *e = static_cast<entry *>(it->second);
-			e->conn = std::forward<Conn_>(conn);
-			e->t = expire;
-			remove_node(e);
-			insert_node(m_time_wheel + slot, e);
+		slot *s = probe(vip);
+		node *n = s ? s->e.load(std::memory_order_relaxed) : nullptr;
+		if (n && n != &m_dead) {
+			entry *e = static_cast<entry *>(n);
+			write_begin();
+			e->conn.store(conn);
+			write_end();
+			uint32_t gen = e->stamp.load(std::memory_order_relaxed) >> 32;
+			e->stamp.store(make_stamp(gen, expire), std::memory_order_relaxed);
+			return;
+		}
+
+		if (m_size >= m_pool.capacity())
+			throw std::runtime_error("session table is full");
+
+		entry *e = m_pool.alloc(vip, conn, make_stamp(m_gen++, expire));
+		insert_node(m_time_wheel + calc_slot(expire), e);
+
+		write_begin();
+		if (!n && m_used + 1 > (m_mask + 1) * 3 / 4) {
+			compact();
+			s = probe(vip);
+			n = s->e.load(std::memory_order_relaxed);
 		}
+		if (!n) ++m_used;
+		s->vip.store(vip);
+		s->e.store(e, std::memory_order_relaxed);
+		++m_size;
+		write_end();
 	}
 
 	bool has(const VIP &vip) {
-		std::lock_guard<std::mutex> guard(m_lock);
-		return m_dict.find(vip) != m_dict.end();
+		Conn conn;
+		uint64_t stamp;
+		return lookup(vip, conn, stamp) != nullptr;
 	}
 
 	Conn get(const VIP &vip) {
-		std::lock_guard<std::mutex> guard(m_lock);
-		auto it = m_dict.find(vip);
-		if (it == m_dict.end())
+		Conn conn;
+		uint64_t stamp;
+		entry *e = lookup(vip, conn, stamp);
+		if (!e)
 			throw std::runtime_error('`' + vip.to_string() + "' not found");
 
-		time_type expire = get_cur_time() + m_expire;
-		size_t slot = calc_slot(expire);
-
-		entry *e = static_cast<entry*>(it->second);
-		e->t = expire;
-		remove_node(e);
-		insert_node(m_time_wheel + slot, e);
-
-		return e->conn;
+		touch(e, stamp);
+		return conn;
 	}
 
 	void del(const VIP &vip) {
 		std::lock_guard<std::mutex> guard(m_lock);
-		auto it = m_dict.find(vip);
-		if (it == m_dict.end())
+		slot *s = probe(vip);
+		node *n = s ? s->e.load(std::memory_order_relaxed) : nullptr;
+		if (!n || n == &m_dead)
 			throw std::runtime_error('`' + vip.to_string() + "' not found");
 
-		m_dict.erase(it);
-		remove_node(it->second);
-		delete it->second;
+		write_begin();
+		erase(s);
+		write_end();
 	}
 
+	// advances the clock and expires due sessions. it is meant to be called
+	// from the i/o loops: it returns right away unless a new second has begun,
+	// and skips the work if another thread is already doing it.
 	void update() {
-		std::lock_guard<std::mutex> guard(m_lock);
 		const time_type now = get_cur_time();
-		if (m_last < 0) m_last = now;
+		if (now <= m_now.load(std::memory_order_relaxed)) return;
+
+		std::unique_lock<std::mutex> guard(m_lock, std::try_to_lock);
+		if (!guard) return;
+		m_now.store(now, std::memory_order_relaxed);
 		while (m_last <= now) {
-			size_t slot = calc_slot(m_last);
-			auto &e = m_time_wheel[slot];
+			size_t slot_index = calc_slot(m_last);
+			auto &e = m_time_wheel[slot_index];
 			node *p = e.next;
 			while (p != &e) {
 				entry *t = static_cast<entry *>(p);
 				p = p->next;
-				if (t->t == m_last) {
-					m_dict.erase(t->vip);
+
+				// entries are filed by the expiry they had when last moved;
+				// refreshed ones are moved to their new slot here
+				time_type expire = stamp_expire(t->stamp.load(std::memory_order_relaxed), m_last);
+				if (expire <= m_last) {
+					write_begin();
+					erase(probe(t->vip));
+					write_end();
+				} else if (size_t to = calc_slot(expire); to != slot_index) {
 					remove_node(t);
+					insert_node(m_time_wheel + to, t);
 				}
 			}
 			++m_last;
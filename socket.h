@@ -14,30 +14,93 @@
 
 extern const socket_t socket_invalid;
 
+// the most datagrams moved by one batched call
+constexpr size_t max_batch = 64;
+
+// the most bytes udp segmentation offload puts in one train of datagrams
+constexpr size_t max_train = 65536;
+
+// one datagram of a batch. on receive, len is the capacity of buf and is
+// replaced by the size of the datagram, and addr is filled with its source.
+// a segmented receive may return a train the kernel coalesced: segment is
+// then the size of its datagrams, all but the last of which are full.
+template <typename Addr>
+struct datagram {
+	void *buf;
+	size_t len;
+	Addr addr;
+	size_t segment;
+};
+
+// one piece of a gathered send
+struct io_slice {
+	const void *buf;
+	size_t len;
+};
+
 socket_t make_udp4(const addr_ipv4 &ad);
 socket_t make_udp6(const addr_ipv6 &ad);
+// binds with SO_REUSEPORT, so several sockets can share ad and split its traffic
+socket_t make_shared_udp4(const addr_ipv4 &ad);
+socket_t make_shared_udp6(const addr_ipv6 &ad);
+// makes the reuseport group of sock pick one of its n sockets by the datagram's source ip
+void steer_by_source4(const socket_t &sock, size_t n);
+void steer_by_source6(const socket_t &sock, size_t n);
 size_t receive_from_socket4(const socket_t &sock, void *buf, size_t len, addr_ipv4 &ad);
 size_t receive_from_socket6(const socket_t &sock, void *buf, size_t len, addr_ipv6 &ad);
 size_t receive_from_socket(const socket_t &sock, void *buf, size_t len);
 size_t send_to_socket4(const socket_t &sock, const void *buf, size_t len, const addr_ipv4 &ad);
 size_t send_to_socket6(const socket_t &sock, const void *buf, size_t len, const addr_ipv6 &ad);
+size_t receive_batch_from_socket4(const socket_t &sock, datagram<addr_ipv4> *dgrams, size_t n);
+size_t receive_batch_from_socket6(const socket_t &sock, datagram<addr_ipv6> *dgrams, size_t n);
+size_t send_batch_to_socket4(const socket_t &sock, const datagram<addr_ipv4> *dgrams, size_t n);
+size_t send_batch_to_socket6(const socket_t &sock, const datagram<addr_ipv6> *dgrams, size_t n);
+
+// turns on udp gro; false if the system has no udp segmentation offload
+bool enable_udp_offload(const socket_t &sock);
+// the batch calls with segmentation offload: runs of same-sized datagrams to
+// one address leave in a single gso send, and trains coalesced by gro arrive whole
+size_t receive_segmented_batch_from_socket4(const socket_t &sock, datagram<addr_ipv4> *dgrams, size_t n);
+size_t receive_segmented_batch_from_socket6(const socket_t &sock, datagram<addr_ipv6> *dgrams, size_t n);
+size_t send_segmented_batch_to_socket4(const socket_t &sock, const datagram<addr_ipv4> *dgrams, size_t n);
+size_t send_segmented_batch_to_socket6(const socket_t &sock, const datagram<addr_ipv6> *dgrams, size_t n);
 
 void connect4(const size_t &sock, const addr_ipv4 &ad);
 void connect6(const size_t &sock, const addr_ipv6 &ad);
 
 socket_t make_tcp4(const addr_ipv4 &ad);
 socket_t make_tcp6(const addr_ipv6 &ad);
+// binds with SO_REUSEPORT, so several listeners can share ad and split its connections
+socket_t make_shared_tcp4(const addr_ipv4 &ad);
+socket_t make_shared_tcp6(const addr_ipv6 &ad);
 
 void listen_tcp(const socket_t &sock);
 
+// socket_invalid if the socket is non-blocking and no connection is pending
 socket_t accept_tcp4(const socket_t &sock, addr_ipv4 &ad);
 socket_t accept_tcp6(const socket_t &sock, addr_ipv6 &ad);
 
 size_t receive_socket(const socket_t &sock, void *buf, size_t len);
 size_t send_socket(const socket_t &sock, const void *buf, size_t len);
+// sends the n slices one after another with a single call; 0 on EAGAIN like send_socket.
+// if zerocopy points to true the data is sent with MSG_ZEROCOPY and must stay as
+// it is until the kernel reports the send done; it is set to false if the kernel
+// had no room to pin it and copied it instead.
+size_t send_socket_gather(const socket_t &sock, const io_slice *slices, size_t n, bool *zerocopy = nullptr);
+// turns on SO_ZEROCOPY; false if the system has no zero-copy sends
+bool enable_zerocopy(const socket_t &sock);
+// takes a notification off the error queue: the zero-copy sends numbered lo to hi,
+// counting from 0, are done, and copied tells if the kernel copied them after all.
+// false once there are none.
+bool read_zerocopy_completion(const socket_t &sock, uint32_t &lo, uint32_t &hi, bool &copied);
 
 void close_socket(socket_t &sock);
 
+// makes blocking receives give up after ms milliseconds; the batch receive then returns 0
+void set_receive_timeout(const socket_t &sock, int ms);
+// receives then return 0 instead of blocking, and batch sends drop what the socket buffer can't take
+void set_nonblocking(const socket_t &sock);
+
 
 template <typename Addr>
 inline socket_t make_udp(const Addr &ad) = delete;
@@ -51,6 +114,30 @@ inline socket_t make_udp<addr_ipv6>(const addr_ipv6 &ad) {
 	return make_udp6(ad);
 };
 
+template <typename Addr>
+inline socket_t make_shared_udp(const Addr &ad) = delete;
+
+template <>
+inline socket_t make_shared_udp<addr_ipv4>(const addr_ipv4 &ad) {
+	return make_shared_udp4(ad);
+}
+template <>
+inline socket_t make_shared_udp<addr_ipv6>(const addr_ipv6 &ad) {
+	return make_shared_udp6(ad);
+}
+
+template <typename Addr>
+inline void steer_by_source(const socket_t &sock, size_t n) = delete;
+
+template <>
+inline void steer_by_source<addr_ipv4>(const socket_t &sock, size_t n) {
+	steer_by_source4(sock, n);
+}
+template <>
+inline void steer_by_source<addr_ipv6>(const socket_t &sock, size_t n) {
+	steer_by_source6(sock, n);
+}
+
 template <typename Addr>
 inline size_t receive_from_socket(const socket_t &sock, void *buf, size_t len, Addr &ad) = delete;
 
@@ -75,6 +162,54 @@ inline size_t send_to_socket<addr_ipv6>(const socket_t &sock, const void *buf, s
 	return send_to_socket6(sock, buf, len, ad);
 }
 
+template <typename Addr>
+inline size_t receive_batch_from_socket(const socket_t &sock, datagram<Addr> *dgrams, size_t n) = delete;
+
+template <>
+inline size_t receive_batch_from_socket<addr_ipv4>(const socket_t &sock, datagram<addr_ipv4> *dgrams, size_t n) {
+	return receive_batch_from_socket4(sock, dgrams, n);
+}
+template <>
+inline size_t receive_batch_from_socket<addr_ipv6>(const socket_t &sock, datagram<addr_ipv6> *dgrams, size_t n) {
+	return receive_batch_from_socket6(sock, dgrams, n);
+}
+
+template <typename Addr>
+inline size_t send_batch_to_socket(const socket_t &sock, const datagram<Addr> *dgrams, size_t n) = delete;
+
+template <>
+inline size_t send_batch_to_socket<addr_ipv4>(const socket_t &sock, const datagram<addr_ipv4> *dgrams, size_t n) {
+	return send_batch_to_socket4(sock, dgrams, n);
+}
+template <>
+inline size_t send_batch_to_socket<addr_ipv6>(const socket_t &sock, const datagram<addr_ipv6> *dgrams, size_t n) {
+	return send_batch_to_socket6(sock, dgrams, n);
+}
+
+template <typename Addr>
+inline size_t receive_segmented_batch_from_socket(const socket_t &sock, datagram<Addr> *dgrams, size_t n) = delete;
+
+template <>
+inline size_t receive_segmented_batch_from_socket<addr_ipv4>(const socket_t &sock, datagram<addr_ipv4> *dgrams, size_t n) {
+	return receive_segmented_batch_from_socket4(sock, dgrams, n);
+}
+template <>
+inline size_t receive_segmented_batch_from_socket<addr_ipv6>(const socket_t &sock, datagram<addr_ipv6> *dgrams, size_t n) {
+	return receive_segmented_batch_from_socket6(sock, dgrams, n);
+}
+
+template <typename Addr>
+inline size_t send_segmented_batch_to_socket(const socket_t &sock, const datagram<Addr> *dgrams, size_t n) = delete;
+
+template <>
+inline size_t send_segmented_batch_to_socket<addr_ipv4>(const socket_t &sock, const datagram<addr_ipv4> *dgrams, size_t n) {
+	return send_segmented_batch_to_socket4(sock, dgrams, n);
+}
+template <>
+inline size_t send_segmented_batch_to_socket<addr_ipv6>(const socket_t &sock, const datagram<addr_ipv6> *dgrams, size_t n) {
+	return send_segmented_batch_to_socket6(sock, dgrams, n);
+}
+
 template <typename Addr>
 inline void connect_socket(const size_t &sock, const Addr &ad) = delete;
 
@@ -100,6 +235,18 @@ inline socket_t make_tcp<addr_ipv6>(const addr_ipv6 &ad) {
 	return make_tcp6(ad);
 };
 
+template <typename Addr>
+inline socket_t make_shared_tcp(const Addr &ad) = delete;
+
+template <>
+inline socket_t make_shared_tcp<addr_ipv4>(const addr_ipv4 &ad) {
+	return make_shared_tcp4(ad);
+}
+template <>
+inline socket_t make_shared_tcp<addr_ipv6>(const addr_ipv6 &ad) {
+	return make_shared_tcp6(ad);
+}
+
 template <typename Addr>
 inline socket_t accept_tcp(const socket_t &sock, Addr &ad) = delete;
 
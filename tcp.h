@@ -2,7 +2,8 @@
 
 #include "socket.h"
 #include "addr.h"
-#include "ring_buffer.h"
+#include "mirror_buffer.h"
+#include "chain_buffer.h"
 #include "cipher.h"
 #include "poller.h"
 
@@ -10,65 +11,217 @@
 #include <algorithm>
 #include <memory>
 #include <functional>
+#include <cstring>
+#include <vector>
 
 template <typename Addr>
 class tcp_listener;
 
+// what the socket doesn't take is queued in a chain_buffer, which grows as
+// far as it must. once it holds more than the high watermark the connection
+// is congested and can_send() refuses new data, until the socket has drained
+// it down to the low watermark.
+//
+// with zero-copy on, everything goes through the buffer, and large writes
+// from it are sent with MSG_ZEROCOPY. the kernel then reads the blocks
+// themselves, so they stay at the front of the buffer, in flight, until
+// reap_zerocopy() finds the send done on the error queue. the poller hands
+// the error queue to the reader, which must reap it.
 template <typename Addr>
 class tcp_conn {
-	static constexpr size_t buffer_cap = 4096;
+	static constexpr size_t default_low_watermark = 64 * 1024;
+	static constexpr size_t default_high_watermark = 256 * 1024;
+	// the most blocks a write from the buffer covers
+	static constexpr size_t max_spans = 8;
+	// smaller writes cost more to pin and notify than to copy; a full record is larger
+	static constexpr size_t zerocopy_min = 10240;
+
+	// a write from the buffer whose bytes are in flight
+	struct inflight_send {
+		size_t len;
+		// the send's number, if it was zero-copy; copied ones are done as soon as the ones before
+		bool zerocopy;
+		uint32_t seq;
+	};
 
-	socket_obj m_sock;
 	Addr m_addr;
-	ring_buffer m_write_buffer{ buffer_cap };
+	chain_buffer m_write_buffer;
+	size_t m_low = default_low_watermark, m_high = default_high_watermark;
+	bool m_congested = false;
+
+	bool m_zerocopy = false;
+	// bytes at the front of the buffer the kernel may still read, and the sends they went out in
+	size_t m_inflight = 0;
+	std::vector<inflight_send> m_sends;
+	// the number of the next zero-copy send, and how many are done
+	uint32_t m_zc_next = 0, m_zc_done = 0;
+	// a send failed; the next recv throws, so the reader drops the connection
+	bool m_broken = false;
+	// declared last, so it is closed before the buffer goes
+	socket_obj m_sock;
 
 	friend class tcp_listener<Addr>;
 
 	tcp_conn() = default;
 
-	void write_to_buffer(const uint8_t *buf, size_t len) {
-		if (buffer_cap - m_write_buffer.size() < len)
-			throw std::runtime_error("write buffer overflow");
-		m_write_buffer.append(buf, len);
+	// send_socket_gather, remembering a failure for the reader
+	size_t gather(const io_slice *slices, size_t n, bool *zerocopy = nullptr) {
+		try {
+			return send_socket_gather(m_sock, slices, n, zerocopy);
+		} catch (std::runtime_error &) {
+			m_broken = true;
+			throw;
+		}
 	}
 
-	void write(const uint8_t *buf, size_t len) {
-		if (!m_write_buffer.empty()) {
-			write_to_buffer(buf, len);
-		} else {
-			size_t n = send_socket(m_sock, buf, len);
-			if (len -= n) {
-				write_to_buffer(buf + n, len);
+	// sends the slices with one call if nothing is queued, and queues what the socket doesn't take
+	void write(const io_slice *slices, size_t n) {
+		if (!m_zerocopy && m_write_buffer.empty()) {
+			size_t sent = gather(slices, n);
+			for (size_t i = 0; i < n; ++i) {
+				size_t skip = std::min(sent, slices[i].len);
+				sent -= skip;
+				if (skip < slices[i].len)
+					m_write_buffer.append(static_cast<const uint8_t *>(slices[i].buf) + skip, slices[i].len - skip);
 			}
+		} else {
+			bool idle = !need_to_wait_write();
+			for (size_t i = 0; i < n; ++i)
+				m_write_buffer.append(static_cast<const uint8_t *>(slices[i].buf), slices[i].len);
+			if (idle)
+				send_buffered();
+		}
+		if (m_write_buffer.size() > m_high)
+			m_congested = true;
+	}
+
+	// sends the first blocks not yet sent with one call; true if the socket took them all
+	bool send_buffered() {
+		const uint8_t *bufs[max_spans];
+		size_t lens[max_spans];
+		size_t n = m_write_buffer.spans(bufs, lens, max_spans, m_inflight);
+		if (!n) return true;
+
+		io_slice slices[max_spans];
+		size_t total = 0;
+		for (size_t i = 0; i < n; ++i) {
+			slices[i] = { bufs[i], lens[i] };
+			total += lens[i];
+		}
+		if (!m_zerocopy && m_sends.empty()) {
+			size_t sent = gather(slices, n);
+			m_write_buffer.consume(sent);
+			return sent == total;
+		}
+
+		bool zc = m_zerocopy && total >= zerocopy_min;
+		size_t sent = gather(slices, n, &zc);
+		if (sent) {
+			m_sends.push_back({ sent, zc, zc ? m_zc_next++ : 0 });
+			m_inflight += sent;
+			release();
 		}
+		return sent == total;
+	}
+
+	// drops the front of the buffer the kernel is done with
+	void release() {
+		size_t k = 0, len = 0;
+		for (; k < m_sends.size(); ++k) {
+			const inflight_send &s = m_sends[k];
+			if (s.zerocopy && static_cast<int32_t>(s.seq - m_zc_done) >= 0) break;
+			len += s.len;
+		}
+		m_sends.erase(m_sends.begin(), m_sends.begin() + k);
+		m_inflight -= len;
+		m_write_buffer.consume(len);
+		if (m_write_buffer.size() <= m_low)
+			m_congested = false;
 	}
 public:
+	// connects to ad
+	explicit tcp_conn(const Addr &ad) : m_addr(ad), m_sock(make_tcp<Addr>(Addr())) {
+		connect_socket<Addr>(m_sock, ad);
+	}
 	tcp_conn(const tcp_conn &) = delete;
 	tcp_conn &operator=(const tcp_conn &) = delete;
 	tcp_conn(tcp_conn &&u) = default;
 	tcp_conn &operator=(tcp_conn &&u) = default;
+	~tcp_conn() {
+		if (m_sends.empty()) return;
+		try {
+			reap_zerocopy();
+		} catch (std::runtime_error &) {
+		}
+		// a closed socket still sends what it has queued, and the kernel may
+		// read the blocks of unreaped zero-copy sends until then. they are left
+		// to it rather than handed back to the pool for the next connection.
+		if (!m_sends.empty())
+			m_write_buffer.abandon(m_inflight);
+	}
 
 	socket_t get_socket() const {
 		return m_sock;
 	}
 
 	size_t send(const void *buf, size_t len) {
-		return write(buf, len), len;
+		io_slice s{ buf, len };
+		return write(&s, 1), len;
+	}
+
+	// sends the slices back to back, with a single syscall when the socket takes them
+	size_t send(const io_slice *slices, size_t n) {
+		size_t total = 0;
+		for (size_t i = 0; i < n; ++i) total += slices[i].len;
+		return write(slices, n), total;
+	}
+
+	void set_watermarks(size_t low, size_t high) {
+		assert(low <= high);
+		m_low = low, m_high = high;
+	}
+
+	// turns on zero-copy sends; false if the system has none
+	bool set_zerocopy() {
+		return m_zerocopy = enable_zerocopy(m_sock);
+	}
+
+	// takes the completions off the error queue and frees the blocks they were for
+	void reap_zerocopy() {
+		if (m_sends.empty()) return;
+		uint32_t lo, hi;
+		bool copied;
+		while (read_zerocopy_completion(m_sock, lo, hi, copied)) {
+			// tcp completes its sends in order
+			if (static_cast<int32_t>(hi + 1 - m_zc_done) > 0)
+				m_zc_done = hi + 1;
+			// the kernel had to copy after all, as it does for a local peer: stop pinning
+			if (copied)
+				m_zerocopy = false;
+		}
+		release();
+	}
+
+	// false while the connection is congested; whatever is sent is queued whole anyway
+	bool can_send() const {
+		return !m_congested;
 	}
 
 	size_t recv(void *buf, size_t len) {
+		if (m_broken)
+			throw std::runtime_error("socket is broken");
 		return receive_socket(m_sock, buf, len);
 	}
 
 	bool on_writable() {
-		m_write_buffer.poll([this](const void *buf, size_t len) {
-			return send_socket(m_sock, buf, len);
-		});
+		while (send_buffered() && need_to_wait_write());
+		if (m_write_buffer.size() <= m_low)
+			m_congested = false;
 		return need_to_wait_write();
 	}
 
 	bool need_to_wait_write() const {
-		return !m_write_buffer.empty();
+		return m_write_buffer.size() > m_inflight;
 	}
 };
 
@@ -80,15 +233,22 @@ class tcp_listener {
 	socket_obj m_sock;
 public:
 	explicit tcp_listener(const Addr &ad) : m_sock(make_tcp<Addr>(ad)) {}
+	// a shared listener joins the SO_REUSEPORT group of ad
+	tcp_listener(const Addr &ad, bool shared) : m_sock(shared ? make_shared_tcp<Addr>(ad) : make_tcp<Addr>(ad)) {}
 	tcp_listener(const tcp_listener &) = delete;
 	tcp_listener &operator=(const tcp_listener &) = delete;
 	tcp_listener(tcp_listener &&u) = default;
 	tcp_listener &operator=(tcp_listener &&u) = default;
 
+	socket_t get_socket() const {
+		return m_sock;
+	}
+
 	void listen() {
 		listen_tcp(m_sock);
 	}
 
+	// on a non-blocking listener with nothing pending, the connection's socket is socket_invalid
 	tcp_conn<Addr> accept() {
 		tcp_conn<Addr> conn;
 		conn.m_sock = accept_tcp<Addr>(m_sock, conn.m_addr);
@@ -101,28 +261,86 @@ using tcp6_listener = tcp_listener<addr_ipv6>;
 
 template <typename Addr, typename Encrypt>
 class stcp_conn : public tcp_conn<Addr>, private Encrypt {
-	static constexpr size_t buffer_cap = 4096;
 	static constexpr size_t head_size = 2 + Encrypt::tag_size;
+	static constexpr size_t max_body = 0x3FFF;
+	static constexpr size_t max_record = head_size + max_body + Encrypt::tag_size;
+	// what a single recv may take in; at least the iv and the largest record
+	static constexpr size_t buffer_cap = 65536;
+	static_assert(buffer_cap >= Encrypt::iv_size + max_record);
 	static_assert(Encrypt::padding_size == 0);
 
-	ring_buffer m_read_buffer{ buffer_cap };
+	mirror_buffer m_read_buffer{ buffer_cap };
 	size_t m_body_size = 0;
 	bool m_send_flag = false, m_recv_flag = false;
+	// the body of the record being coalesced, behind room for its head
+	std::unique_ptr<uint8_t[]> m_pending;
+	size_t m_pending_len = 0;
+
+	// decrypts the next whole record of the read buffer in place and passes
+	// its body to f; false if it hasn't all arrived yet
+	template <typename F>
+	bool next_record(F &f) {
+		if (!m_recv_flag) {
+			if (m_read_buffer.size() < Encrypt::iv_size)
+				return false;
+			Encrypt::init(nullptr, nullptr, m_read_buffer.data());
+			m_read_buffer.consume(Encrypt::iv_size);
+			m_recv_flag = true;
+		}
 
-	bool read(uint8_t *buf, size_t len) {
-		size_t m = m_read_buffer.size(), n = std::min(len, m);
-		if (len -= n) {
-			size_t k = tcp_conn<Addr>::recv(buf + n, len);
-			if (k < len) {
-				m_read_buffer.append(buf + n, k);
+		if (!m_body_size) {
+			if (m_read_buffer.size() < head_size)
 				return false;
-			}
-		} else {
-			m_read_buffer.poll(buf, n);
+
+			uint16_t l;
+			size_t n = Encrypt::decrypt(m_read_buffer.data(), head_size, reinterpret_cast<uint8_t *>(&l), sizeof(l));
+			assert(n == sizeof(l));
+			m_read_buffer.consume(head_size);
+			m_body_size = static_cast<size_t>(ntohs(l));
 		}
+
+		size_t size = m_body_size + Encrypt::tag_size;
+		if (m_read_buffer.size() < size)
+			return false;
+
+		// contiguous however the ring wraps
+		uint8_t *body = m_read_buffer.data();
+		size_t n = Encrypt::decrypt(body, size, body, size);
+		m_body_size = 0;
+		f(body, n);
+		m_read_buffer.consume(size);
 		return true;
 	}
 
+	// seals the len bytes of body at record + head_size in place, puts the head in
+	// front and sends them together
+	void send_record(uint8_t *record, size_t len) {
+		// a congested connection drops the record before it takes a nonce, so
+		// the stream stays in step
+		if (!tcp_conn<Addr>::can_send())
+			throw std::runtime_error("write buffer is full");
+
+		// the first record carries the iv in front of it
+		uint8_t iv[Encrypt::iv_size];
+		size_t k = 0;
+		io_slice slices[2];
+		if (!m_send_flag) {
+			RAND_bytes(iv, sizeof(iv));
+			Encrypt::init(nullptr, iv, nullptr);
+			slices[k++] = { iv, sizeof(iv) };
+			m_send_flag = true;
+		}
+
+		uint16_t l = htons(static_cast<uint16_t>(len));
+		size_t n = Encrypt::encrypt(reinterpret_cast<const uint8_t*>(&l), sizeof(l), record, head_size);
+		assert(n == head_size);
+
+		n += Encrypt::encrypt(record + head_size, len, record + head_size, len + Encrypt::tag_size);
+		assert(n <= max_record);
+		slices[k++] = { record, n };
+		tcp_conn<Addr>::send(slices, k);
+	}
+
 public:
 	// stcp_conn(const tcp_conn<Addr> &c, const uint8_t *key) : tcp_conn<Addr>(c) {
 	// 	Encrypt::init(key, nullptr, nullptr);
@@ -132,58 +350,50 @@ public:
 	}
 
 	size_t send(const void *buf, size_t len) {
-		if (len > 0x3FFF)
+		if (len > max_body)
 			throw std::range_error("send length is up to 0x3FFF");
 
-		if (!m_send_flag) {
-			uint8_t iv[Encrypt::iv_size];
-			RAND_bytes(iv, sizeof(iv));
-			Encrypt::init(nullptr, iv, nullptr);
-			tcp_conn<Addr>::send(iv, sizeof(iv));
-			m_send_flag = true;
-		}
-
-		uint16_t l = htons(static_cast<uint16_t>(len));
-		uint8_t head[head_size] = {};
-		size_t n = Encrypt::encrypt(reinterpret_cast<const uint8_t*>(&l), sizeof(l), head, sizeof(head));
-		assert(n == sizeof(head));
-		tcp_conn<Addr>::send(head, n);
-
-		std::unique_ptr<uint8_t[]> cipher_buf(new uint8_t[len + Encrypt::tag_size]);
-		n = Encrypt::encrypt(static_cast<const uint8_t *>(buf), len, cipher_buf.get(), len + Encrypt::tag_size);
-		assert(n <= len + Encrypt::tag_size);
-		tcp_conn<Addr>::send(cipher_buf.get(), n);
-
+		// the encrypted head and body are built next to each other and sent together
+		thread_local static uint8_t record[max_record];
+		std::memcpy(record + head_size, buf, len);
+		send_record(record, len);
 		return len;
 	}
 
-	size_t recv(void *buf, size_t len) {
-		if (!m_recv_flag) {
-			uint8_t iv[Encrypt::iv_size];
-			if (!read(iv, sizeof(iv)))
-				return 0;
-			Encrypt::init(nullptr, nullptr, iv);
-			m_recv_flag = true;
-		}
-
-		if (!m_body_size) {
-			uint8_t head[head_size];
-			if (!read(head, head_size))
-				return 0;
-
-			uint16_t l;
-			size_t n = Encrypt::decrypt(head, head_size, reinterpret_cast<uint8_t *>(&l), sizeof(l));
-			assert(n == sizeof(l));
-			m_body_size = static_cast<size_t>(ntohs(l));
-		}
+	// adds a packet to the record the next flush() sends, flushing first if it
+	// doesn't fit. the receiver tells the packets apart by their ip headers.
+	void queue(const void *buf, size_t len) {
+		if (len > max_body)
+			throw std::range_error("send length is up to 0x3FFF");
+		if (!m_pending)
+			m_pending.reset(new uint8_t[max_record]);
+		if (m_pending_len + len > max_body)
+			flush();
+		std::memcpy(m_pending.get() + head_size + m_pending_len, buf, len);
+		m_pending_len += len;
+	}
 
-		size_t size = m_body_size + Encrypt::tag_size;
-		std::unique_ptr<uint8_t[]> cipher_buf(new uint8_t[size]);
-		if (!read(cipher_buf.get(), size))
-			return 0;
+	// sends the queued packets as one record, sealed with a single aead call
+	void flush() {
+		if (!m_pending_len) return;
+		size_t len = m_pending_len;
+		m_pending_len = 0;
+		send_record(m_pending.get(), len);
+	}
 
-		m_body_size = 0;
-		return Encrypt::decrypt(cipher_buf.get(), size, static_cast<uint8_t *>(buf), len);
+	// takes in as much as the socket holds and the read buffer has room for,
+	// with a single recv, then passes the body of every whole record to
+	// f(uint8_t *body, size_t len), decrypted in place. a body is only valid
+	// during its call. false once the socket is drained, and throws once the
+	// peer has closed it.
+	template <typename F>
+	bool receive(F &&f) {
+		size_t n = tcp_conn<Addr>::recv(m_read_buffer.space(), m_read_buffer.room());
+		m_read_buffer.commit(n);
+		while (next_record(f));
+		// a short read doesn't mean EAGAIN: a fin may have come in with the
+		// data, on the same edge. only the next recv tells.
+		return n != 0;
 	}
 };
 
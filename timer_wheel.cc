@@ -0,0 +1,132 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+timer_wheel::timer_wheel(uint64_t now) : m_next(now + 1) {}
+
+timer_wheel::~timer_wheel() {
+	for (auto &it : m_timers) delete it.second;
+}
+
+void timer_wheel::link(node *head, node *n) {
+	n->prev = head->prev;
+	n->next = head;
+	head->prev->next = n;
+	head->prev = n;
+}
+
+void timer_wheel::unlink(node *n) {
+	n->prev->next = n->next;
+	n->next->prev = n->prev;
+	n->prev = n->next = n;
+}
+
+void timer_wheel::insert(timer *t) {
+	// a timer already due runs on the next tick
+	uint64_t expires = std::max(t->expires, m_next);
+	uint64_t delta = std::min(expires - m_next, max_delta);
+	expires = m_next + delta;
+
+	size_t level = 0;
+	while (level + 1 < levels && delta >= uint64_t(1) << (bits * (level + 1)))
+		++level;
+	link(&m_wheel[level][(expires >> (bits * level)) & mask], t);
+}
+
+// moves the timers of a slot down to where they belong now
+void timer_wheel::cascade(size_t level, size_t index) {
+	node &head = m_wheel[level][index];
+	while (head.next != &head) {
+		timer *t = static_cast<timer *>(head.next);
+		unlink(t);
+		insert(t);
+	}
+}
+
+timer_wheel::timer_id timer_wheel::add(uint64_t expires, uint64_t period, callback f) {
+	timer *t = new timer;
+	t->id = ++m_last_id;
+	t->expires = expires;
+	t->period = period;
+	t->f = std::move(f);
+	m_timers.emplace(t->id, t);
+	insert(t);
+	return t->id;
+}
+
+void timer_wheel::cancel(timer_id id) {
+	auto it = m_timers.find(id);
+	if (it == m_timers.end()) return;
+	timer *t = it->second;
+	if (t == m_running) {
+		m_running_cancelled = true;
+		return;
+	}
+	unlink(t);
+	m_timers.erase(it);
+	delete t;
+}
+
+void timer_wheel::advance(uint64_t now) {
+	if (m_timers.empty()) {
+		m_next = std::max(m_next, now + 1);
+		return;
+	}
+
+	while (m_next <= now) {
+		size_t index = m_next & mask;
+		// when a level wraps around, the next slot of the level above is due
+		for (size_t level = 1; level < levels && (m_next >> (bits * (level - 1)) & mask) == 0; ++level)
+			cascade(level, (m_next >> (bits * level)) & mask);
+		++m_next;
+
+		node due;
+		node &head = m_wheel[0][index];
+		if (head.next == &head) continue;
+		// taken out first, so the timers run can add to this slot safely
+		due.next = head.next, due.prev = head.prev;
+		due.next->prev = due.prev->next = &due;
+		head.next = head.prev = &head;
+
+		while (due.next != &due) {
+			timer *t = static_cast<timer *>(due.next);
+			unlink(t);
+			m_running = t, m_running_cancelled = false;
+			t->f();
+			m_running = nullptr;
+
+			if (t->period && !m_running_cancelled) {
+				t->expires += t->period;
+				insert(t);
+			} else {
+				m_timers.erase(t->id);
+				delete t;
+			}
+		}
+	}
+}
+
+uint64_t timer_wheel::next_expiry() const {
+	uint64_t ans = never;
+	for (size_t k = 0; k < slots; ++k) {
+		const node &head = m_wheel[0][(m_next + k) & mask];
+		if (head.next != &head) {
+			ans = m_next + k;
+			break;
+		}
+	}
+
+	// a timer of a higher level may come down and fire as soon as its slot is cascaded
+	for (size_t level = 1; level < levels; ++level) {
+		// the first block whose cascade is still to come
+		uint64_t block = (m_next + (uint64_t(1) << (bits * level)) - 1) >> (bits * level);
+		for (size_t k = 0; k < slots; ++k) {
+			const node &head = m_wheel[level][(block + k) & mask];
+			if (head.next != &head) {
+				ans = std::min(ans, (block + k) << (bits * level));
+				break;
+			}
+		}
+	}
+	return ans;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+// one-shot and periodic timers on a hierarchical timing wheel, ticking in
+// milliseconds. the first level has a slot per tick for the next 64 ticks,
+// every further level a slot per 64 slots of the one below, and a slot is
+// cascaded down when the level below wraps around. adding, cancelling and
+// expiring a timer are constant time, whatever the number of timers.
+//
+// it doesn't read the clock or sleep: the owner tells it the time in
+// advance() and asks next_expiry() how long it may sleep.
+class timer_wheel {
+public:
+	using timer_id = uint64_t;
+	using callback = std::function<void()>;
+
+	static constexpr uint64_t never = UINT64_MAX;
+
+	explicit timer_wheel(uint64_t now);
+	timer_wheel(const timer_wheel &) = delete;
+	timer_wheel &operator=(const timer_wheel &) = delete;
+	~timer_wheel();
+
+	// calls f at tick expires, then every period ticks if period isn't 0
+	timer_id add(uint64_t expires, uint64_t period, callback f);
+	// a timer that has fired for the last time, or was cancelled, is ignored
+	void cancel(timer_id id);
+	// runs the timers due up to now. they may add and cancel timers, themselves
+	// included, but must not throw
+	void advance(uint64_t now);
+	// no timer fires before the returned tick; never if there are none
+	uint64_t next_expiry() const;
+
+	size_t size() const {
+		return m_timers.size();
+	}
+
+private:
+	static constexpr size_t bits = 6, slots = 1 << bits, mask = slots - 1, levels = 4;
+	// the farthest a timer can be put; it is cascaded again from there until due
+	static constexpr uint64_t max_delta = (uint64_t(1) << (bits * levels)) - 1;
+
+	struct node {
+		node *prev = this, *next = this;
+	};
+	struct timer : node {
+		timer_id id;
+		uint64_t expires, period;
+		callback f;
+	};
+
+	node m_wheel[levels][slots];
+	// the next tick to run
+	uint64_t m_next;
+	timer_id m_last_id = 0;
+	std::unordered_map<timer_id, timer *> m_timers;
+	// the timer being run, and whether it cancelled itself
+	timer *m_running = nullptr;
+	bool m_running_cancelled = false;
+
+	void insert(timer *t);
+	void cascade(size_t level, size_t index);
+	static void link(node *head, node *n);
+	static void unlink(node *n);
+};
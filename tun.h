@@ -2,6 +2,9 @@
 
 #include <stddef.h>
 #include <string>
+#include <vector>
+
+#include "packet.h"
 
 #if defined(_WIN32)
 	#include "windows/tun.h"
@@ -10,6 +13,17 @@
 #endif
 
 tun_t tun_alloc(std::string &name);
+std::vector<tun_t> tun_alloc(std::string &name, size_t queues);
+// opens the queues with IFF_VNET_HDR and tcp segmentation offload: every
+// packet then starts with a virtio_net_hdr, and reads may return tcp
+// super-packets of up to 64k. see vnet.h.
+std::vector<tun_t> tun_alloc_vnet(std::string &name, size_t queues);
 size_t tun_read(const tun_t &tun, void *buf, size_t len);
+// reads a packet if one is queued, returns 0 otherwise
+size_t tun_try_read(const tun_t &tun, void *buf, size_t len);
+// blocks for the first packet, then reads whatever else is queued, up to n packets
+size_t tun_read_batch(const tun_t &tun, packet_buf *pkts, size_t n);
+// reads whatever is queued without blocking, up to n packets
+size_t tun_try_read_batch(const tun_t &tun, packet_buf *pkts, size_t n);
 size_t tun_write(const tun_t &tun, const void *buf, size_t len);
 void tun_free(tun_t &tun);
\ No newline at end of file
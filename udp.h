@@ -2,9 +2,15 @@
 
 #include <string>
 #include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <vector>
+#include <functional>
 
 #include "socket.h"
 #include "addr.h"
+#include "packet.h"
 
 template <typename Addr>
 class udp {
@@ -12,6 +18,8 @@ class udp {
 public:
 	udp() : m_sock(make_udp(Addr())) {}
 	explicit udp(const Addr &ad) : m_sock(make_udp<Addr>(ad)) {}
+	// a shared socket joins the SO_REUSEPORT group of ad
+	udp(const Addr &ad, bool shared) : m_sock(shared ? make_shared_udp<Addr>(ad) : make_udp<Addr>(ad)) {}
 	udp(const udp &) = delete;
 	udp &operator=(const udp &) = delete;
 
@@ -29,10 +37,27 @@ public:
 		close_socket(m_sock);
 	}
 
+	socket_t get_socket() const {
+		return m_sock;
+	}
+
 	void connect(const Addr &ad) {
 		connect_socket<Addr>(m_sock, ad);
 	}
 
+	void set_receive_timeout(int ms) {
+		::set_receive_timeout(m_sock, ms);
+	}
+
+	void set_nonblocking() {
+		::set_nonblocking(m_sock);
+	}
+
+	// sends each client of the reuseport group to one of its n sockets, by source ip
+	void steer_by_source(size_t n) {
+		::steer_by_source<Addr>(m_sock, n);
+	}
+
 	size_t sendto(const void *buf, size_t len, const Addr &ad) {
 		return send_to_socket<Addr>(m_sock, buf, len, ad);
 	}
@@ -43,32 +68,232 @@ public:
 	size_t recvfrom(void *buf, size_t len) {
 		return receive_from_socket(m_sock, buf, len);
 	}
+
+	size_t send_batch(const datagram<Addr> *dgrams, size_t n) {
+		return send_batch_to_socket<Addr>(m_sock, dgrams, n);
+	}
+
+	size_t recv_batch(datagram<Addr> *dgrams, size_t n) {
+		return receive_batch_from_socket<Addr>(m_sock, dgrams, n);
+	}
+
+	bool enable_offload() {
+		return enable_udp_offload(m_sock);
+	}
+
+	size_t send_segmented_batch(const datagram<Addr> *dgrams, size_t n) {
+		return send_segmented_batch_to_socket<Addr>(m_sock, dgrams, n);
+	}
+
+	size_t recv_segmented_batch(datagram<Addr> *dgrams, size_t n) {
+		return receive_segmented_batch_from_socket<Addr>(m_sock, dgrams, n);
+	}
 };
 
 template <typename Addr, typename Encrypt>
 class sudp : public udp<Addr>, private Encrypt {
+	// datagrams received with gro, still to be split into packets. their
+	// segments are decrypted where they sit and handed out as views of the
+	// trains. every segment but the first has the tag of the one before in
+	// front of it, as room for the caller's headers once that is decrypted,
+	// and every train has as much room in front of its first.
+	struct trains {
+		static constexpr size_t count = 16;
+		static constexpr size_t lead = Encrypt::tailroom;
+		static constexpr size_t stride = lead + max_train;
+		std::unique_ptr<uint8_t[]> buf{ new uint8_t[count * stride] };
+		datagram<Addr> dgrams[count];
+		// received trains, the one being split and the offset in it
+		size_t n = 0, cur = 0, off = 0;
+		// the caller's own buffers, kept while it holds views in their place
+		std::vector<packet_buf> lent;
+
+		trains() {
+			lent.reserve(max_batch);
+		}
+
+		bool holds(const packet_buf &p) const {
+			std::less<const uint8_t *> lt;
+			return !lt(p.data(), buf.get()) && lt(p.data(), buf.get() + count * stride);
+		}
+	};
+	std::unique_ptr<trains> m_trains;
+
 public:
-	sudp() {}
-	explicit sudp(const Addr &ad) : udp<Addr>(ad) {}
+	// packets handed to sudp must reserve this much room around the payload
+	static constexpr size_t headroom = Encrypt::headroom;
+	static constexpr size_t tailroom = Encrypt::tailroom;
 
-	size_t sendto(const void *buf, size_t len, const Addr &ad) {
-		std::unique_ptr<uint8_t[]> cipher_buf(new uint8_t[len + Encrypt::min_cap]);
-		uint8_t key[] = "12345612345678901234561234567890";
-		size_t n = Encrypt::encrypt(key, static_cast<const uint8_t*>(buf), len, cipher_buf.get(), len + Encrypt::min_cap);
-		return udp<Addr>::sendto(cipher_buf.get(), n, ad);
+	sudp() {
+		init_key();
+	}
+	explicit sudp(const Addr &ad) : udp<Addr>(ad) {
+		init_key();
+	}
+	sudp(const Addr &ad, bool shared) : udp<Addr>(ad, shared) {
+		init_key();
 	}
 
-	size_t recvfrom(void *buf, size_t len, Addr &ad) {
-		std::unique_ptr<uint8_t[]> cipher_buf(new uint8_t[len + Encrypt::min_cap]);
-		uint8_t key[] = "12345612345678901234561234567890";
-		size_t n = udp<Addr>::recvfrom(cipher_buf.get(), len - Encrypt::min_cap, ad);
-		return Encrypt::decrypt(key, cipher_buf.get(), n, static_cast<uint8_t *>(buf), len);
+	// encrypts p in place, for when it is sent some other way
+	void seal(packet_buf &p) {
+		Encrypt::encrypt(p);
 	}
-	size_t recvfrom(void *buf, size_t len) {
-		std::unique_ptr<uint8_t[]> cipher_buf(new uint8_t[len + Encrypt::min_cap]);
+
+	// decrypts a datagram received some other way in place; throws if it isn't authentic
+	void open(packet_buf &p) {
+		Encrypt::decrypt(p);
+	}
+
+	// encrypts p in place and sends it
+	size_t sendto(packet_buf &p, const Addr &ad) {
+		Encrypt::encrypt(p);
+		return udp<Addr>::sendto(p.data(), p.size(), ad);
+	}
+
+	// receives into p and decrypts it in place
+	size_t recvfrom(packet_buf &p, Addr &ad) {
+		prepare(p);
+		p.resize(udp<Addr>::recvfrom(p.data(), p.tailroom(), ad));
+		Encrypt::decrypt(p);
+		return p.size();
+	}
+	size_t recvfrom(packet_buf &p) {
+		prepare(p);
+		p.resize(udp<Addr>::recvfrom(p.data(), p.tailroom()));
+		Encrypt::decrypt(p);
+		return p.size();
+	}
+
+	// sends and receives trains of datagrams with udp gso/gro from now on.
+	// returns false, and changes nothing, if the system can't. the socket must
+	// then be read by a single thread, as a train may span recv_batch calls,
+	// and always into the same packets: they may come back as views of the
+	// trains, which the next call swaps for the packets' own buffers again.
+	bool enable_offload() {
+		if (!m_trains) {
+			if (!udp<Addr>::enable_offload()) return false;
+			m_trains.reset(new trains);
+		}
+		return true;
+	}
+
+	// true while received trains have segments recv_batch hasn't handed out.
+	// they are off the socket, so a poller doesn't see them.
+	bool has_pending() const {
+		return m_trains && m_trains->cur < m_trains->n;
+	}
+
+	size_t send_batch(packet_buf *pkts, const Addr *addrs, size_t n) {
+		datagram<Addr> dgrams[max_batch];
+		n = std::min(n, max_batch);
+		for (size_t i = 0; i < n; ++i) {
+			Encrypt::encrypt(pkts[i]);
+			dgrams[i].buf = pkts[i].data();
+			dgrams[i].len = pkts[i].size();
+			dgrams[i].addr = addrs[i];
+		}
+		if (m_trains)
+			return udp<Addr>::send_segmented_batch(dgrams, n);
+		return udp<Addr>::send_batch(dgrams, n);
+	}
+
+	// packets that fail to decrypt are dropped, the rest are packed to the front
+	size_t recv_batch(packet_buf *pkts, Addr *addrs, size_t n) {
+		if (m_trains)
+			return recv_trains(pkts, addrs, n);
+
+		datagram<Addr> dgrams[max_batch];
+		n = std::min(n, max_batch);
+		for (size_t i = 0; i < n; ++i) {
+			prepare(pkts[i]);
+			dgrams[i].buf = pkts[i].data();
+			dgrams[i].len = pkts[i].tailroom();
+		}
+
+		size_t m = udp<Addr>::recv_batch(dgrams, n), k = 0;
+		for (size_t i = 0; i < m; ++i) {
+			packet_buf &p = pkts[i];
+			p.resize(dgrams[i].len);
+			try {
+				Encrypt::decrypt(p);
+			} catch (std::runtime_error &) {
+				continue;
+			}
+			if (k != i) std::swap(pkts[k], p);
+			addrs[k++] = dgrams[i].addr;
+		}
+		return k;
+	}
+
+private:
+	void init_key() {
 		uint8_t key[] = "12345612345678901234561234567890";
-		size_t n = udp<Addr>::recvfrom(cipher_buf.get(), len - Encrypt::min_cap);
-		return Encrypt::decrypt(key, cipher_buf.get(), n, static_cast<uint8_t *>(buf), len);
+		Encrypt::init(key);
+	}
+
+	// hands out the datagrams of the trains received last, and only receives
+	// more once they are all gone
+	size_t recv_trains(packet_buf *pkts, Addr *addrs, size_t n) {
+		trains &t = *m_trains;
+		for (size_t i = 0; i < n && !t.lent.empty(); ++i) {
+			if (t.holds(pkts[i])) {
+				pkts[i] = std::move(t.lent.back());
+				t.lent.pop_back();
+			}
+		}
+
+		if (t.cur == t.n) {
+			for (size_t i = 0; i < trains::count; ++i) {
+				t.dgrams[i].buf = t.buf.get() + i * trains::stride + trains::lead;
+				t.dgrams[i].len = max_train;
+			}
+			t.n = udp<Addr>::recv_segmented_batch(t.dgrams, trains::count);
+			t.cur = t.off = 0;
+		}
+
+		size_t k = 0;
+		while (k < n && t.cur < t.n) {
+			const datagram<Addr> &d = t.dgrams[t.cur];
+			uint8_t *src = static_cast<uint8_t *>(d.buf) + t.off;
+			size_t len = std::min(d.segment, d.len - t.off);
+			if ((t.off += len) == d.len) {
+				++t.cur;
+				t.off = 0;
+			}
+
+			packet_buf &p = pkts[k];
+			prepare(p);
+			// a caller that wants more room in front than a segment has gets a copy
+			if (p.headroom() > trains::lead) {
+				if (len > p.tailroom()) continue;
+				std::memcpy(p.data(), src, len);
+				p.resize(len);
+				try {
+					Encrypt::decrypt(p);
+				} catch (std::runtime_error &) {
+					continue;
+				}
+			} else {
+				packet_buf view(src - trains::lead, trains::lead, len, 0);
+				view.resize(len);
+				try {
+					Encrypt::decrypt(view);
+				} catch (std::runtime_error &) {
+					continue;
+				}
+				t.lent.push_back(std::move(p));
+				p = std::move(view);
+			}
+			addrs[k++] = d.addr;
+		}
+		return k;
+	}
+
+	// points p at where a datagram must land so its plaintext ends up behind the headroom
+	static void prepare(packet_buf &p) {
+		p.reset();
+		p.push(headroom);
+		p.resize(0);
 	}
 };
 
@@ -54,6 +54,37 @@ inline auto parse_dst_ip<IPv6>(uint8_t *data) -> IPv6 {
 	return ans;
 }
 
+// the size of the ip packet at data by its header, or 0 if len doesn't hold
+// all of it or the size is too small for its own header
+inline size_t ip_packet_size(const uint8_t *data, size_t len) {
+	if (len < 1) return 0;
+	size_t size;
+	switch (data[0] >> 4) {
+	case 4:
+		if (len < 20) return 0;
+		size = static_cast<size_t>(data[2]) << 8 | data[3];
+		if (size < 20) return 0;
+		break;
+	case 6:
+		if (len < 40) return 0;
+		size = 40 + (static_cast<size_t>(data[4]) << 8 | data[5]);
+		break;
+	default:
+		return 0;
+	}
+	return size <= len ? size : 0;
+}
+
+// calls f(data, size) for every ip packet of the ones laid end to end in
+// data; the bytes from the first that isn't a whole packet on are skipped
+template <typename F>
+inline void for_each_ip_packet(uint8_t *data, size_t len, F &&f) {
+	while (size_t size = ip_packet_size(data, len)) {
+		f(data, size);
+		data += size, len -= size;
+	}
+}
+
 template <typename T, typename CT, CT *close, T invalid = 0>
 class movable_fd {
 	T m_fd;
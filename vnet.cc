@@ -0,0 +1,321 @@
+#include "vnet.h"
+
+#include <cstring>
+#include <algorithm>
+
+// the internet checksum is the same whatever the byte order of the words
+// summed, so the data is summed in host order, a word at a time, and the
+// result stored back the same way. len must be even but for the last call.
+static uint64_t csum_add(uint64_t sum, const uint8_t *p, size_t len) {
+	for (; len >= 4; p += 4, len -= 4) {
+		uint32_t w;
+		memcpy(&w, p, sizeof(w));
+		sum += w;
+	}
+	if (len >= 2) {
+		uint16_t w;
+		memcpy(&w, p, sizeof(w));
+		sum += w;
+		p += 2, len -= 2;
+	}
+	if (len) {
+		uint8_t b[2] = { *p, 0 };
+		uint16_t w;
+		memcpy(&w, b, sizeof(w));
+		sum += w;
+	}
+	return sum;
+}
+
+static void csum_store(uint8_t *at, uint64_t sum) {
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	uint16_t csum = ~static_cast<uint16_t>(sum);
+	memcpy(at, &csum, sizeof(csum));
+}
+
+static uint16_t get16(const uint8_t *p) {
+	return p[0] << 8 | p[1];
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8, p[1] = v & 0xff;
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24, p[1] = v >> 16 & 0xff, p[2] = v >> 8 & 0xff, p[3] = v & 0xff;
+}
+
+vnet_reader::vnet_reader(const tun_t &tun) :
+	m_tun(tun), m_frame(new uint8_t[frame_size]), m_pkt(m_frame.get() + sizeof(vnet_hdr)) {
+}
+
+// loads the next frame and works out how to cut it up. malformed frames are
+// dropped by leaving nothing to hand out.
+bool vnet_reader::next_frame(bool wait) {
+	size_t len = wait ? tun_read(m_tun, m_frame.get(), frame_size) : tun_try_read(m_tun, m_frame.get(), frame_size);
+	if (len == 0) return false;
+
+	m_len = m_off = m_seg = 0;
+	if (len < sizeof(vnet_hdr)) return true;
+	memcpy(&m_hdr, m_frame.get(), sizeof(m_hdr));
+	m_len = len - sizeof(vnet_hdr);
+
+	uint8_t type = m_hdr.gso_type & ~vnet_hdr::gso_ecn;
+	m_gso = type == vnet_hdr::gso_tcpv4 || type == vnet_hdr::gso_tcpv6;
+	if (!m_gso) {
+		// a plain packet, which may still be waiting for its checksum
+		m_hlen = 0, m_mss = m_len;
+		if (m_hdr.flags & vnet_hdr::needs_csum) {
+			size_t start = m_hdr.csum_start, at = start + m_hdr.csum_offset;
+			if (at + 2 > m_len) {
+				m_len = 0;
+				return true;
+			}
+			csum_store(m_pkt + at, csum_add(0, m_pkt + start, m_len - start));
+		}
+		return true;
+	}
+
+	unsigned version = type == vnet_hdr::gso_tcpv4 ? 4 : 6;
+	size_t l4 = m_hdr.csum_start;
+	if (!(m_hdr.flags & vnet_hdr::needs_csum) || m_hdr.gso_size == 0 || m_len < 1
+		|| m_pkt[0] >> 4 != version || l4 < (version == 4 ? 20 : 40) || l4 + 20 > m_len) {
+		m_len = 0;
+		return true;
+	}
+	m_hlen = l4 + (m_pkt[l4 + 12] >> 4) * 4;
+	m_mss = m_hdr.gso_size;
+	if (m_hlen < l4 + 20 || m_hlen > m_len) {
+		m_len = 0;
+		return true;
+	}
+	m_off = m_hlen;
+	return true;
+}
+
+bool vnet_reader::next_segment(packet_buf &p) {
+	size_t start = m_off, len = std::min(m_mss, m_len - m_off), seg = m_seg++;
+	m_off += len;
+
+	p.reset();
+	if (m_hlen + len > p.capacity()) return false;
+	uint8_t *d = p.data();
+	memcpy(d, m_pkt, m_hlen);
+	memcpy(d + m_hlen, m_pkt + start, len);
+	p.resize(m_hlen + len);
+	if (!m_gso) return true;
+
+	size_t l4 = m_hdr.csum_start, tcp_len = p.size() - l4;
+	uint8_t *tcp = d + l4;
+	uint64_t sum;
+	if (d[0] >> 4 == 4) {
+		put16(d + 2, p.size());
+		put16(d + 4, get16(d + 4) + seg);
+		d[10] = d[11] = 0;
+		csum_store(d + 10, csum_add(0, d, l4));
+
+		uint8_t pseudo[12];
+		memcpy(pseudo, d + 12, 8);
+		pseudo[8] = 0, pseudo[9] = 6;
+		put16(pseudo + 10, tcp_len);
+		sum = csum_add(0, pseudo, sizeof(pseudo));
+	} else {
+		put16(d + 4, p.size() - 40);
+
+		uint8_t pseudo[40] {};
+		memcpy(pseudo, d + 8, 32);
+		put32(pseudo + 32, tcp_len);
+		pseudo[39] = 6;
+		sum = csum_add(0, pseudo, sizeof(pseudo));
+	}
+
+	// only the last segment keeps fin and psh, only the first keeps cwr
+	put32(tcp + 4, get32(tcp + 4) + seg * m_mss);
+	if (m_off < m_len) tcp[13] &= ~0x09;
+	if (seg > 0) tcp[13] &= ~0x80;
+
+	uint8_t *csum = tcp + m_hdr.csum_offset;
+	csum[0] = csum[1] = 0;
+	csum_store(csum, csum_add(sum, tcp, tcp_len));
+	return true;
+}
+
+size_t vnet_reader::read_batch(packet_buf *pkts, size_t n) {
+	size_t k = 0;
+	while (k < n) {
+		if (m_off >= m_len) {
+			if (!next_frame(k == 0)) break;
+			continue;
+		}
+		if (next_segment(pkts[k])) ++k;
+	}
+	return k;
+}
+
+// what coalescing needs to know about a tcp segment
+struct tcp_segment {
+	bool ok;
+	size_t l4, hlen, payload;
+	uint32_t seq;
+	uint8_t flags;
+};
+
+enum : uint8_t { tcp_fin = 0x01, tcp_psh = 0x08, tcp_ack = 0x10 };
+
+// a data segment with a valid checksum and nothing but ack and psh set.
+// ip options, extension headers and fragments are left alone.
+static bool parse_segment(const packet_buf &p, tcp_segment &s) {
+	const uint8_t *d = p.data();
+	size_t len = p.size();
+	uint64_t sum;
+	if (len >= 20 && d[0] == 0x45) {
+		if (d[9] != 6 || get16(d + 2) != len || (get16(d + 6) & 0x3fff) != 0) return false;
+		s.l4 = 20;
+		uint8_t pseudo[12];
+		memcpy(pseudo, d + 12, 8);
+		pseudo[8] = 0, pseudo[9] = 6;
+		put16(pseudo + 10, len - s.l4);
+		sum = csum_add(0, pseudo, sizeof(pseudo));
+	} else if (len >= 40 && d[0] >> 4 == 6) {
+		if (d[6] != 6 || get16(d + 4) + 40u != len) return false;
+		s.l4 = 40;
+		uint8_t pseudo[40] {};
+		memcpy(pseudo, d + 8, 32);
+		put32(pseudo + 32, len - s.l4);
+		pseudo[39] = 6;
+		sum = csum_add(0, pseudo, sizeof(pseudo));
+	} else {
+		return false;
+	}
+
+	if (len < s.l4 + 20) return false;
+	s.hlen = s.l4 + (d[s.l4 + 12] >> 4) * 4;
+	s.flags = d[s.l4 + 13];
+	if (s.hlen < s.l4 + 20 || s.hlen >= len || (s.flags & ~tcp_psh) != tcp_ack) return false;
+	s.payload = len - s.hlen;
+	s.seq = get32(d + s.l4 + 4);
+
+	// once merged, the stack takes the checksum on trust, so check it here
+	uint8_t zero[2] = {};
+	sum = csum_add(sum, d + s.l4, len - s.l4);
+	csum_store(zero, sum);
+	return zero[0] == 0 && zero[1] == 0;
+}
+
+// whether b can follow a in a gso frame made of segments the size of a
+static bool can_follow(const packet_buf &pa, const tcp_segment &a, const packet_buf &pb, const tcp_segment &b) {
+	const uint8_t *x = pa.data(), *y = pb.data();
+	if (a.l4 != b.l4 || a.hlen != b.hlen || (a.flags & tcp_psh) || b.payload > a.payload
+		|| b.seq != a.seq + a.payload)
+		return false;
+
+	// the same ip header but for the length, id and checksum
+	if (a.l4 == 20) {
+		if (x[1] != y[1] || x[6] != y[6] || x[8] != y[8] || memcmp(x + 12, y + 12, 8) != 0) return false;
+	} else if (memcmp(x, y, 4) != 0 || memcmp(x + 6, y + 6, 34) != 0) {
+		return false;
+	}
+
+	// the same ports, ack, window and options
+	const uint8_t *tx = x + a.l4, *ty = y + b.l4;
+	return memcmp(tx, ty, 4) == 0 && memcmp(tx + 8, ty + 8, 5) == 0
+		&& memcmp(tx + 14, ty + 14, 2) == 0 && memcmp(tx + 18, ty + 18, a.hlen - a.l4 - 18) == 0;
+}
+
+vnet_writer::vnet_writer(const tun_t &tun) :
+	m_tun(tun), m_frame(new uint8_t[vnet_reader::frame_size]) {
+}
+
+vnet_writer::~vnet_writer() = default;
+
+// builds one gso frame out of the headers of the first segment and the
+// payloads of all n. the tcp checksum only covers the pseudo header, as
+// NEEDS_CSUM asks.
+void vnet_writer::write_merged(packet_buf *pkts, const tcp_segment *segs, size_t n) {
+	const tcp_segment &first = segs[0], &last = segs[n - 1];
+
+	uint8_t *d = m_frame.get() + sizeof(vnet_hdr), *end = d + first.hlen;
+	memcpy(d, pkts[0].data(), first.hlen);
+	for (size_t i = 0; i < n; ++i) {
+		memcpy(end, pkts[i].data() + first.hlen, pkts[i].size() - first.hlen);
+		end += pkts[i].size() - first.hlen;
+	}
+	size_t len = end - d, l4_len = len - first.l4;
+
+	vnet_hdr hdr {};
+	hdr.flags = vnet_hdr::needs_csum;
+	hdr.gso_type = first.l4 == 20 ? vnet_hdr::gso_tcpv4 : vnet_hdr::gso_tcpv6;
+	hdr.hdr_len = first.hlen;
+	hdr.gso_size = first.payload;
+	hdr.csum_start = first.l4;
+	hdr.csum_offset = 16;
+	memcpy(m_frame.get(), &hdr, sizeof(hdr));
+
+	uint64_t sum;
+	if (first.l4 == 20) {
+		put16(d + 2, len);
+		d[10] = d[11] = 0;
+		csum_store(d + 10, csum_add(0, d, 20));
+
+		uint8_t pseudo[12];
+		memcpy(pseudo, d + 12, 8);
+		pseudo[8] = 0, pseudo[9] = 6;
+		put16(pseudo + 10, l4_len);
+		sum = csum_add(0, pseudo, sizeof(pseudo));
+	} else {
+		put16(d + 4, l4_len);
+
+		uint8_t pseudo[40] {};
+		memcpy(pseudo, d + 8, 32);
+		put32(pseudo + 32, l4_len);
+		pseudo[39] = 6;
+		sum = csum_add(0, pseudo, sizeof(pseudo));
+	}
+
+	uint8_t *tcp = d + first.l4;
+	tcp[13] |= last.flags & tcp_psh;
+	// csum_store complements; the field wants the folded sum itself
+	csum_store(tcp + 16, sum);
+	tcp[16] = ~tcp[16], tcp[17] = ~tcp[17];
+
+	tun_write(m_tun, m_frame.get(), sizeof(vnet_hdr) + len);
+}
+
+void vnet_writer::write_batch(packet_buf *pkts, size_t n) {
+	const size_t max_len = 65535;
+	m_segs.resize(n);
+	for (size_t i = 0; i < n; ++i)
+		m_segs[i].ok = parse_segment(pkts[i], m_segs[i]);
+
+	for (size_t i = 0; i < n; ) {
+		// every segment but the last must carry as much as the first
+		const size_t mss = m_segs[i].payload;
+		size_t j = i + 1, len = pkts[i].size();
+		if (m_segs[i].ok) {
+			while (j < n && m_segs[j].ok && m_segs[j - 1].payload == mss && len + m_segs[j].payload <= max_len
+				&& can_follow(pkts[j - 1], m_segs[j - 1], pkts[j], m_segs[j])) {
+				len += m_segs[j].payload;
+				++j;
+			}
+		}
+
+		if (j - i == 1)
+			vnet_write(m_tun, pkts[i]);
+		else
+			write_merged(pkts + i, m_segs.data() + i, j - i);
+		i = j;
+	}
+}
+
+size_t vnet_write(const tun_t &tun, packet_buf &p) {
+	uint8_t *hdr = p.push(sizeof(vnet_hdr));
+	memset(hdr, 0, sizeof(vnet_hdr));
+	size_t size = tun_write(tun, p.data(), p.size());
+	p.pull(sizeof(vnet_hdr));
+	return size;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "tun.h"
+#include "packet.h"
+
+// the virtio_net_hdr in front of every packet of a vnet tun, in host byte order
+struct vnet_hdr {
+	enum : uint8_t { needs_csum = 1 };
+	enum : uint8_t { gso_none = 0, gso_tcpv4 = 1, gso_tcpv6 = 4, gso_ecn = 0x80 };
+
+	uint8_t flags;
+	uint8_t gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+};
+static_assert(sizeof(vnet_hdr) == 10, "vnet_hdr must match virtio_net_hdr");
+
+// reads a vnet tun and cuts the tcp super-packets it returns back into
+// packets of gso_size payload, fixing their ip and tcp headers and
+// checksums the way the kernel's gso would. segments that don't fit in one
+// read_batch are handed out by the next one.
+class vnet_reader {
+	const tun_t &m_tun;
+	std::unique_ptr<uint8_t[]> m_frame;
+	vnet_hdr m_hdr {};
+	bool m_gso = false;
+	// the packet behind the header and its size
+	uint8_t *m_pkt;
+	size_t m_len = 0;
+	// the ip and tcp headers copied in front of every segment, and the payload per segment
+	size_t m_hlen = 0, m_mss = 0;
+	// where the payload not handed out yet starts, and how many segments are out
+	size_t m_off = 0, m_seg = 0;
+
+	bool next_frame(bool wait);
+	bool next_segment(packet_buf &p);
+
+public:
+	// a header and the largest packet the kernel hands over
+	static constexpr size_t frame_size = sizeof(vnet_hdr) + 65536;
+
+	explicit vnet_reader(const tun_t &tun);
+	vnet_reader(const vnet_reader &) = delete;
+	vnet_reader &operator=(const vnet_reader &) = delete;
+
+	// blocks until there is something to hand out, then fills up to n
+	// packets from the current super-packet and whatever else is queued
+	size_t read_batch(packet_buf *pkts, size_t n);
+};
+
+// writes p to a vnet tun behind an empty header; p needs sizeof(vnet_hdr) of headroom
+size_t vnet_write(const tun_t &tun, packet_buf &p);
+
+// writes batches to a vnet tun the way gro would hand them to the stack:
+// a run of consecutive, in-order segments of one tcp flow goes out as a
+// single gso frame, everything else as it is.
+struct tcp_segment;
+
+class vnet_writer {
+	const tun_t &m_tun;
+	std::unique_ptr<uint8_t[]> m_frame;
+	std::vector<tcp_segment> m_segs;
+
+	void write_merged(packet_buf *pkts, const tcp_segment *segs, size_t n);
+
+public:
+	explicit vnet_writer(const tun_t &tun);
+	~vnet_writer();
+	vnet_writer(const vnet_writer &) = delete;
+	vnet_writer &operator=(const vnet_writer &) = delete;
+
+	void write_batch(packet_buf *pkts, size_t n);
+};
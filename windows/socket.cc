@@ -47,6 +47,30 @@ socket_t make_udp6(const addr_ipv6 &ad) {
 	return fd;
 }
 
+socket_t make_shared_udp4(const addr_ipv4 &ad) {
+	throw runtime_error("make_shared_udp4: SO_REUSEPORT is not supported on windows");
+}
+
+socket_t make_shared_udp6(const addr_ipv6 &ad) {
+	throw runtime_error("make_shared_udp6: SO_REUSEPORT is not supported on windows");
+}
+
+socket_t make_shared_tcp4(const addr_ipv4 &ad) {
+	throw runtime_error("make_shared_tcp4: SO_REUSEPORT is not supported on windows");
+}
+
+socket_t make_shared_tcp6(const addr_ipv6 &ad) {
+	throw runtime_error("make_shared_tcp6: SO_REUSEPORT is not supported on windows");
+}
+
+void steer_by_source4(const socket_t &sock, size_t n) {
+	throw runtime_error("steer_by_source4: SO_REUSEPORT is not supported on windows");
+}
+
+void steer_by_source6(const socket_t &sock, size_t n) {
+	throw runtime_error("steer_by_source6: SO_REUSEPORT is not supported on windows");
+}
+
 size_t receive_from_socket4(const socket_t &sock, void *buf, size_t len, addr_ipv4 &ad) {
 	int size;
 	char *p = reinterpret_cast<char *>(buf);
@@ -100,12 +124,82 @@ size_t send_to_socket6(const socket_t &sock, const void *buf, size_t len, const
 	return size;
 }
 
+// winsock has no recvmmsg/sendmmsg, so the batch calls move one datagram per syscall
+static bool wait_readable(const socket_t &sock) {
+	int timeout = 0, len = sizeof(timeout);
+	if (getsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<char *>(&timeout), &len) != 0 || timeout == 0)
+		return true;
+
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(sock, &fds);
+	timeval tv{ timeout / 1000, timeout % 1000 * 1000 };
+	return select(0, &fds, nullptr, nullptr, &tv) > 0;
+}
+
+size_t receive_batch_from_socket4(const socket_t &sock, datagram<addr_ipv4> *dgrams, size_t n) {
+	if (n == 0 || !wait_readable(sock)) return 0;
+	dgrams[0].len = dgrams[0].segment = receive_from_socket4(sock, dgrams[0].buf, dgrams[0].len, dgrams[0].addr);
+	return 1;
+}
+
+size_t receive_batch_from_socket6(const socket_t &sock, datagram<addr_ipv6> *dgrams, size_t n) {
+	if (n == 0 || !wait_readable(sock)) return 0;
+	dgrams[0].len = dgrams[0].segment = receive_from_socket6(sock, dgrams[0].buf, dgrams[0].len, dgrams[0].addr);
+	return 1;
+}
+
+size_t send_batch_to_socket4(const socket_t &sock, const datagram<addr_ipv4> *dgrams, size_t n) {
+	for (size_t i = 0; i < n; ++i)
+		send_to_socket4(sock, dgrams[i].buf, dgrams[i].len, dgrams[i].addr);
+	return n;
+}
+
+size_t send_batch_to_socket6(const socket_t &sock, const datagram<addr_ipv6> *dgrams, size_t n) {
+	for (size_t i = 0; i < n; ++i)
+		send_to_socket6(sock, dgrams[i].buf, dgrams[i].len, dgrams[i].addr);
+	return n;
+}
+
+// there is no udp segmentation offload here; the segmented calls never make trains
+bool enable_udp_offload(const socket_t &sock) {
+	return false;
+}
+
+size_t receive_segmented_batch_from_socket4(const socket_t &sock, datagram<addr_ipv4> *dgrams, size_t n) {
+	return receive_batch_from_socket4(sock, dgrams, n);
+}
+
+size_t receive_segmented_batch_from_socket6(const socket_t &sock, datagram<addr_ipv6> *dgrams, size_t n) {
+	return receive_batch_from_socket6(sock, dgrams, n);
+}
+
+size_t send_segmented_batch_to_socket4(const socket_t &sock, const datagram<addr_ipv4> *dgrams, size_t n) {
+	return send_batch_to_socket4(sock, dgrams, n);
+}
+
+size_t send_segmented_batch_to_socket6(const socket_t &sock, const datagram<addr_ipv6> *dgrams, size_t n) {
+	return send_batch_to_socket6(sock, dgrams, n);
+}
+
 void close_socket(socket_t &sock) {
 	if (sock == socket_invalid) return;
 	closesocket(sock);
 	sock = socket_invalid;
 }
 
+void set_receive_timeout(const socket_t &sock, int ms) {
+	DWORD timeout = ms;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&timeout), sizeof(timeout)) != 0)
+		throw runtime_error("set_receive_timeout: setsockopt returns err " + last_error_str());
+}
+
+void set_nonblocking(const socket_t &sock) {
+	u_long on = 1;
+	if (ioctlsocket(sock, FIONBIO, &on) != 0)
+		throw runtime_error("set_nonblocking: ioctlsocket returns err " + last_error_str());
+}
+
 void connect4(const size_t &sock, const addr_ipv4 &ad) {
 	SOCKADDR_IN saddr{};
 	set_sockaddr_in(saddr, ad);
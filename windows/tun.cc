@@ -1,5 +1,6 @@
 #include <stdexcept>
 #include <string>
+#include <algorithm>
 
 #include "wintun.h"
 #include "../tun.h"
@@ -64,6 +65,16 @@ tun_t tun_alloc(std::string &name) {
 	return { adapter, session };
 }
 
+std::vector<tun_t> tun_alloc(std::string &name, size_t queues) {
+	if (queues > 1)
+		throw runtime_error("multi-queue tun is not supported by wintun");
+	return { tun_alloc(name) };
+}
+
+std::vector<tun_t> tun_alloc_vnet(std::string &name, size_t queues) {
+	throw runtime_error("vnet headers are not supported by wintun");
+}
+
 size_t tun_read(const tun_t &tun, void *buf, size_t len) {
 	DWORD size;
 	BYTE *packet = WintunReceivePacket(tun.session, &size);
@@ -79,6 +90,54 @@ size_t tun_read(const tun_t &tun, void *buf, size_t len) {
 	}
 }
 
+size_t tun_try_read(const tun_t &tun, void *buf, size_t len) {
+	DWORD size;
+	BYTE *packet = WintunReceivePacket(tun.session, &size);
+	if (!packet) {
+		if (GetLastError() != ERROR_NO_MORE_ITEMS)
+			throw runtime_error("fail to read from the tun: " + last_error_str());
+		return 0;
+	}
+	memcpy(buf, packet, size = std::min<size_t>(size, len));
+	WintunReleaseReceivePacket(tun.session, packet);
+	return size;
+}
+
+size_t tun_read_batch(const tun_t &tun, packet_buf *pkts, size_t n) {
+	if (n == 0) return 0;
+	pkts[0].reset();
+	pkts[0].resize(tun_read(tun, pkts[0].data(), pkts[0].capacity()));
+
+	size_t i = 1;
+	for (; i < n; ++i) {
+		DWORD size;
+		BYTE *packet = WintunReceivePacket(tun.session, &size);
+		if (!packet) {
+			if (GetLastError() != ERROR_NO_MORE_ITEMS)
+				throw runtime_error("fail to read from the tun: " + last_error_str());
+			break;
+		}
+		packet_buf &p = pkts[i];
+		p.reset();
+		p.resize(std::min<size_t>(size, p.capacity()));
+		memcpy(p.data(), packet, p.size());
+		WintunReleaseReceivePacket(tun.session, packet);
+	}
+	return i;
+}
+
+size_t tun_try_read_batch(const tun_t &tun, packet_buf *pkts, size_t n) {
+	size_t i = 0;
+	for (; i < n; ++i) {
+		packet_buf &p = pkts[i];
+		p.reset();
+		size_t size = tun_try_read(tun, p.data(), p.capacity());
+		if (size == 0) break;
+		p.resize(size);
+	}
+	return i;
+}
+
 size_t tun_write(const tun_t &tun, const void *buf, size_t len) {
 	BYTE *packet = WintunAllocateSendPacket(tun.session, len);
 	if (packet) {